@@ -18,6 +18,7 @@ import (
 	"github.com/livegrep/livegrep/server/log"
 	"github.com/livegrep/livegrep/server/reqid"
 	"github.com/livegrep/livegrep/server/templates"
+	pb "github.com/livegrep/livegrep/src/proto/go_proto"
 )
 
 type Templates struct {
@@ -203,6 +204,24 @@ func (s *server) ServeStats(ctx context.Context, w http.ResponseWriter, r *http.
 	})
 }
 
+// ServeMetrics passes on a backend's metrics, in the Prometheus text
+// format, for scraping.
+func (s *server) ServeMetrics(ctx context.Context, w http.ResponseWriter, r *http.Request) {
+	backendName := r.URL.Query().Get(":backend")
+	bk := s.bk[backendName]
+	if bk == nil {
+		http.Error(w, fmt.Sprintf("unknown backend '%s'\n", backendName), 404)
+		return
+	}
+	reply, err := bk.Codesearch.Metrics(ctx, &pb.Empty{})
+	if err != nil {
+		http.Error(w, err.Error(), 502)
+		return
+	}
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	io.WriteString(w, reply.Text)
+}
+
 func (s *server) requestProtocol(r *http.Request) string {
 	if s.config.ReverseProxy {
 		if proto := r.Header.Get("X-Real-Proto"); len(proto) > 0 {
@@ -290,6 +309,7 @@ func New(cfg *config.Config) (http.Handler, error) {
 	m := pat.New()
 	m.Add("GET", "/debug/healthcheck", http.HandlerFunc(srv.ServeHealthcheck))
 	m.Add("GET", "/debug/stats", srv.Handler(srv.ServeStats))
+	m.Add("GET", "/debug/metrics/:backend", srv.Handler(srv.ServeMetrics))
 	m.Add("GET", "/search/:backend", srv.Handler(srv.ServeSearch))
 	m.Add("GET", "/search/", srv.Handler(srv.ServeSearch))
 	m.Add("GET", "/view/databricks/:repo/", srv.Handler(srv.ServeFile))
@@ -7,6 +7,7 @@
  ********************************************************************/
 #include "src/lib/radix_sort.h"
 #include "src/lib/metrics.h"
+#include "src/lib/probes.h"
 
 #include "src/chunk.h"
 #include "src/codesearch.h"
@@ -23,6 +24,7 @@ metric index_fixupnl("timer.index.fixupnl");
 using re2::StringPiece;
 
 DECLARE_bool(index);
+DECLARE_bool(line_directory);
 
 void chunk::add_chunk_file(indexed_file *sf, const StringPiece& line)
 {
@@ -56,6 +58,14 @@ void chunk::add_chunk_file(indexed_file *sf, const StringPiece& line)
     cf.right = r;
 }
 
+void chunk::add_posting(indexed_file *sf, const StringPiece& line,
+                        int lno, int piece) {
+    if (!postings)
+        postings = new line_postings;
+    line_posting p = { uint32_t(sf->no), uint32_t(lno), uint32_t(piece) };
+    postings->add((unsigned char*)line.data() - data, p);
+}
+
 void chunk::finish_file() {
     int right = -1;
     sort(cur_file.begin(), cur_file.end());
@@ -71,6 +81,7 @@ void chunk::finish_file() {
 int chunk::chunk_files = 0;
 
 void chunk::finalize() {
+    PROBE(chunk__finalize__start, id, size);
     if (FLAGS_index) {
         // For the purposes of livegrep's line-based sorting, we need
         // to sort \n before all other characters. divsufsort,
@@ -91,6 +102,11 @@ void chunk::finalize() {
             std::replace(data, data + size, '\0', '\n');
         }
     }
+    if (FLAGS_line_directory) {
+        lines = new line_directory;
+        lines->build(data, size);
+    }
+    PROBE(chunk__finalize__done, id);
 }
 
 void chunk::finalize_files() {
@@ -111,38 +127,51 @@ void chunk::finalize_files() {
     }
     files.resize(out - files.begin());
 
-    build_tree_names();
-    build_tree();
+    if (postings)
+        postings->finalize(data, size);
+
+    build_ranges();
 }
 
-void chunk::build_tree_names() {
-    for (auto it = files.begin(); it != files.end(); it++) {
-        for (auto it2 = it->files.begin(); it2 != it->files.end(); it2++) {
-            tree_names.insert((*it2)->tree->name);
+void chunk::build_ranges() {
+    assert(is_sorted(files.begin(), files.end()));
+    ranges_buf.clear();
+    range_files_buf.clear();
+    tree_bits_buf.clear();
+    for (auto it = files.begin(); it != files.end(); ++it) {
+        chunk_range r = {
+            uint32_t(it->left), uint32_t(it->right),
+            uint32_t(range_files_buf.size()), uint32_t(it->files.size())
+        };
+        ranges_buf.push_back(r);
+        for (auto it2 = it->files.begin(); it2 != it->files.end(); ++it2) {
+            range_files_buf.push_back((*it2)->no);
+            int id = (*it2)->tree->id;
+            if (tree_bits_buf.size() <= size_t(id / 64))
+                tree_bits_buf.resize(id / 64 + 1);
+            tree_bits_buf[id / 64] |= uint64_t(1) << (id % 64);
         }
     }
-}
+    nranges = ranges_buf.size();
+    ranges = ranges_buf.data();
+    range_files = range_files_buf.data();
+    ntree_words = tree_bits_buf.size();
+    tree_bits = tree_bits_buf.data();
 
-void chunk::build_tree() {
-    assert(is_sorted(files.begin(), files.end()));
-    cf_root = build_tree(0, files.size());
+    range_limits_buf.resize(nranges);
+    range_limits = range_limits_buf.data();
+    build_limits(0, nranges);
+
+    vector<chunk_file>().swap(files);
 }
 
-chunk_file_node *chunk::build_tree(int left, int right) {
+uint32_t chunk::build_limits(uint32_t left, uint32_t right) {
     if (right == left)
         return 0;
-    int mid = (left + right) / 2;
-    chunk_file_node *node = new chunk_file_node;
-
-    node->chunk = &files[mid];
-    node->left  = build_tree(left, mid);
-    node->right = build_tree(mid + 1, right);
-    node->right_limit = node->chunk->right;
-    if (node->left && node->left->right_limit > node->right_limit)
-        node->right_limit = node->left->right_limit;
-    if (node->right && node->right->right_limit > node->right_limit)
-        node->right_limit = node->right->right_limit;
-    assert(!node->left  || *(node->left->chunk) < *(node->chunk));
-    assert(!node->right || *(node->chunk) < *(node->right->chunk));
-    return node;
+    uint32_t mid = (left + right) / 2;
+    uint32_t limit = ranges[mid].right;
+    limit = max(limit, build_limits(left, mid));
+    limit = max(limit, build_limits(mid + 1, right));
+    range_limits_buf[mid] = limit;
+    return limit;
 }
@@ -20,6 +20,9 @@
 
 #include <stdint.h>
 
+#include "src/line_directory.h"
+#include "src/postings.h"
+
 struct indexed_file;
 namespace re2 {
     class StringPiece;
@@ -49,20 +52,17 @@ struct chunk_file {
 
 const size_t kMaxGap       = 1 << 10;
 
-struct chunk_file_node {
-    chunk_file *chunk;
-    int right_limit;
-
-    chunk_file_node *left, *right;
-
-    ~chunk_file_node() {
-        if (left != NULL) {
-            delete left;
-        }
-        if (right != NULL) {
-            delete right;
-        }
-    }
+/*
+ * An entry in a chunk's range table, the flat form of a chunk_file:
+ * bytes `left' through `right' (inclusive) of the chunk's data are
+ * present in each of the files numbered range_files[first, first +
+ * count).
+ */
+struct chunk_range {
+    uint32_t left;
+    uint32_t right;
+    uint32_t first;
+    uint32_t count;
 };
 
 struct chunk {
@@ -70,16 +70,14 @@ struct chunk {
     static int chunk_files;
 
     int id;     // Sequential id
+    int node;   // Home NUMA node; always 0 without --numa
     int size;
 
     // Collects references to all files which contain lines stored in this
-    // chunk's data. Sorted (and compacted) at the very end of index creation.
+    // chunk's data. Sorted (and compacted) at the very end of index creation,
+    // then converted into `ranges`.
     vector<chunk_file> files;
 
-    // Collects the names of all trees indexed in this chunk, to enable
-    // short-circuiting based on a repo constraint.
-    set<string> tree_names;
-
     // Transient during index creation. Collects references to the file
     // currently being processed by the code_searcher, when that file contains
     // lines stored in this chunk's data. One the code_searcher finishes
@@ -87,10 +85,30 @@ struct chunk {
     // finish_file(), and this vector is cleared.
     vector<chunk_file> cur_file;
 
-    // BST constructed from `files` at the very end of index creation. Used to
-    // efficiently find, given a substring of this chunk's data, the files
-    // might contain that substring.
-    chunk_file_node *cf_root;
+    // The searchable form of `files`, built at the very end of index
+    // creation by build_ranges() and used directly from the mmap of a
+    // loaded index. `ranges` is sorted by position.
+    uint32_t nranges;
+    const chunk_range *ranges;
+    const uint32_t *range_files;
+    // An interval tree over `ranges`, stored implicitly: the root of
+    // the subtree covering ranges [l, r) is (l + r) / 2, and
+    // range_limits[i] is the largest `right` in the subtree rooted at i.
+    const uint32_t *range_limits;
+
+    // A bitset of the ids of all trees indexed in this chunk, to
+    // enable short-circuiting based on a repo constraint.
+    uint32_t ntree_words;
+    const uint64_t *tree_bits;
+
+    // Optional exact map from each line in `data' to the files and line
+    // numbers where it occurs; built at finalization when
+    // --line_postings is set, and NULL otherwise.
+    line_postings *postings;
+
+    // Optional rank/select directory over the newlines in `data'; built
+    // at finalization when --line_directory is set, and NULL otherwise.
+    line_directory *lines;
 
     // The suffix array; constructed from `data` during finalization (once the
     // chunk's data block is full, but before all files have been processed).
@@ -99,20 +117,34 @@ struct chunk {
     // Many lines of code, from many files, concatenated together.
     unsigned char *data;
 
+    // Backing storage for the range table when built in memory.
+    vector<chunk_range> ranges_buf;
+    vector<uint32_t> range_files_buf;
+    vector<uint32_t> range_limits_buf;
+    vector<uint64_t> tree_bits_buf;
+
     chunk(unsigned char *data, uint32_t *suffixes)
-        : size(0), files(), cf_root(0),
-          suffixes(suffixes), data(data) { }
+        : node(0), size(0), files(), nranges(0), ranges(0), range_files(0),
+          range_limits(0), ntree_words(0), tree_bits(0), postings(0),
+          lines(0), suffixes(suffixes), data(data) { }
 
     ~chunk() {
-        delete cf_root;
+        delete postings;
+        delete lines;
     }
 
     void add_chunk_file(indexed_file *sf, const StringPiece& line);
+    void add_posting(indexed_file *sf, const StringPiece& line,
+                     int lno, int piece);
     void finish_file();
     void finalize();
     void finalize_files();
-    void build_tree_names();
-    void build_tree();
+    void build_ranges();
+
+    bool has_tree(int id) const {
+        return uint32_t(id / 64) < ntree_words &&
+            (tree_bits[id / 64] & (uint64_t(1) << (id % 64)));
+    }
 
     struct lt_suffix {
         const chunk *chunk_;
@@ -150,7 +182,7 @@ struct chunk {
         }
     };
 
-    chunk_file_node *build_tree(int left, int right);
+    uint32_t build_limits(uint32_t left, uint32_t right);
 
 private:
     chunk(const chunk&);
@@ -6,6 +6,7 @@
  * modify it under the terms listed in the COPYING file.
  ********************************************************************/
 #include "src/lib/debug.h"
+#include "src/lib/numa.h"
 
 #include "src/chunk_allocator.h"
 #include "src/chunk.h"
@@ -13,10 +14,12 @@
 #include <gflags/gflags.h>
 
 #include <sys/mman.h>
+#include <mutex>
 #include <thread>
 
 DECLARE_int32(threads);
 DECLARE_bool(index);
+DECLARE_bool(numa);
 DEFINE_int32(chunk_power, 27, "Size of search chunks, as a power of two");
 size_t kChunkSize = (1 << 27);
 
@@ -31,6 +34,71 @@ static bool validate_chunk_power(const char* flagname, int32_t value) {
 static const bool dummy = gflags::RegisterFlagValidator(&FLAGS_chunk_power,
                                                         validate_chunk_power);
 
+DEFINE_string(huge_pages, "", "Back chunk data and suffix arrays with huge pages: "
+              "'thp' (transparent huge pages) or 'hugetlb' (MAP_HUGETLB, falling back to thp)");
+
+static bool validate_huge_pages(const char* flagname, const string& value) {
+    return value == "" || value == "thp" || value == "hugetlb";
+}
+
+static const bool dummy_huge = gflags::RegisterFlagValidator(&FLAGS_huge_pages,
+                                                             validate_huge_pages);
+
+namespace {
+    const size_t kHugePageSize = (1UL << 21);
+
+    size_t huge_round(size_t len) {
+        return (len + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    }
+};
+
+bool use_huge_pages() {
+    return !FLAGS_huge_pages.empty();
+}
+
+/*
+ * Suffix-array probes land all over a chunk, so with 4K pages nearly
+ * every one misses the TLB. MAP_HUGETLB needs pages reserved in
+ * advance; when there are none, fall back to transparent huge pages,
+ * which want a 2MB-aligned region marked MADV_HUGEPAGE.
+ */
+void *alloc_huge(size_t len) {
+    if (!use_huge_pages())
+        return NULL;
+    len = huge_round(len);
+    void *p;
+    if (FLAGS_huge_pages == "hugetlb") {
+        p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            return p;
+        static std::once_flag warned;
+        std::call_once(warned, []() {
+                perror("mmap(MAP_HUGETLB); using transparent huge pages");
+            });
+    }
+    p = mmap(NULL, len + kHugePageSize, PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    // Trim the over-allocation to a huge-page boundary.
+    uintptr_t base = uintptr_t(p);
+    uintptr_t aligned = (base + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    if (aligned > base)
+        munmap(p, aligned - base);
+    munmap(reinterpret_cast<void*>(aligned + len), base + kHugePageSize - aligned);
+    p = reinterpret_cast<void*>(aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(p, len, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+void free_huge(void *p, size_t len) {
+    if (p)
+        munmap(p, huge_round(len));
+}
+
 void chunk_allocator::finalize_worker(chunk_allocator *alloc) {
     chunk *c;
     while (alloc->finalize_queue_.pop(&c)) {
@@ -96,8 +164,21 @@ void chunk_allocator::new_chunk()  {
     finish_chunk();
     current_ = alloc_chunk();
     madvise(current_->data,     chunk_size_,                               MADV_RANDOM);
-    madvise(current_->suffixes, chunk_size_ * sizeof(*current_->suffixes), MADV_RANDOM);
+    if (current_->suffixes)
+        madvise(current_->suffixes, chunk_size_ * sizeof(*current_->suffixes), MADV_RANDOM);
     current_->id = chunks_.size();
+    if (FLAGS_numa) {
+        // Interleave chunks across nodes. This places anonymous memory;
+        // the page cache behind a mapped index follows the thread that
+        // first reads it instead (see load_allocator::load_chunks).
+        current_->node = current_->id % numa_nodes();
+        if (numa_nodes() > 1) {
+            numa_place(current_->data, chunk_size_, current_->node);
+            if (current_->suffixes)
+                numa_place(current_->suffixes, chunk_size_ * sizeof(*current_->suffixes),
+                           current_->node);
+        }
+    }
     by_data_[current_->data] = current_;
     chunks_.push_back(current_);
 }
@@ -124,6 +205,18 @@ void chunk_allocator::skip_chunk() {
 void chunk_allocator::drop_caches() {
 }
 
+size_t chunk_allocator::lock_pages(int sa_levels) {
+    return 0;
+}
+
+void chunk_allocator::prefetch(const chunk *chunk, int sa_levels) {
+}
+
+size_t chunk_allocator::resident_bytes(const chunk *chunk, size_t *total) {
+    *total = chunk->size * (chunk->suffixes ? 1 + sizeof(uint32_t) : 1);
+    return *total;
+}
+
 chunk *chunk_allocator::chunk_from_string(const unsigned char *p) {
     auto it = by_data_.lower_bound(p);
     if (it == by_data_.end() || it->first != p) {
@@ -136,7 +229,17 @@ chunk *chunk_allocator::chunk_from_string(const unsigned char *p) {
 
 class mem_allocator : public chunk_allocator {
 public:
+    mem_allocator() : huge_(use_huge_pages()) {}
+
     virtual chunk *alloc_chunk() {
+        if (huge_) {
+            unsigned char *buf = static_cast<unsigned char*>(alloc_huge(chunk_size_));
+            uint32_t *idx = FLAGS_index ?
+                static_cast<uint32_t*>(alloc_huge(chunk_size_ * sizeof(uint32_t))) : 0;
+            if (buf && (idx || !FLAGS_index))
+                return new chunk(buf, idx);
+            die("Unable to allocate huge pages for a chunk");
+        }
         unsigned char *buf = new unsigned char[chunk_size_];
         uint32_t *idx = FLAGS_index ? new uint32_t[chunk_size_] : 0;
         return new chunk(buf, idx);
@@ -148,10 +251,18 @@ public:
     }
 
     virtual void free_chunk(chunk *chunk) {
-        delete[] chunk->data;
-        delete[] chunk->suffixes;
+        if (huge_) {
+            free_huge(chunk->data, chunk_size_);
+            free_huge(chunk->suffixes, chunk_size_ * sizeof(uint32_t));
+        } else {
+            delete[] chunk->data;
+            delete[] chunk->suffixes;
+        }
         delete chunk;
     }
+
+protected:
+    bool huge_;
 };
 
 chunk_allocator *make_mem_allocator() {
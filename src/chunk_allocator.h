@@ -74,6 +74,18 @@ public:
     chunk *chunk_from_string(const unsigned char *p);
 
     virtual void drop_caches();
+    // mlock() the pages of the finished chunks that searches always
+    // read, and those of each suffix array that the first `sa_levels'
+    // steps of a binary search land on. Returns the bytes locked. Only
+    // allocators that map an index from disk lock anything.
+    virtual size_t lock_pages(int sa_levels);
+    // Start reading in, in the background, a chunk's data if
+    // `sa_levels' is 0, for a scan; otherwise only the suffix-array
+    // pages that lock_pages(sa_levels) would lock.
+    virtual void prefetch(const chunk *chunk, int sa_levels);
+    // Estimate how many of the bytes of a chunk's data and suffix array
+    // are in memory; *total is set to their size.
+    virtual size_t resident_bytes(const chunk *chunk, size_t *total);
 protected:
     static void finalize_worker(chunk_allocator *);
 
@@ -108,4 +120,11 @@ protected:
 
 const size_t kContentChunkSize = (1UL << 22);
 
+// Whether --huge_pages asks for chunk memory to be backed by huge pages.
+bool use_huge_pages();
+// Allocate `len' bytes of anonymous memory backed by huge pages as
+// --huge_pages directs, or return NULL. Release it with free_huge().
+void *alloc_huge(size_t len);
+void free_huge(void *p, size_t len);
+
 #endif
@@ -20,9 +20,14 @@
 
 #include "src/lib/timer.h"
 #include "src/lib/metrics.h"
-#include "src/lib/thread_queue.h"
+#include "src/lib/bounded_queue.h"
 #include "src/lib/radix_sort.h"
 #include "src/lib/per_thread.h"
+#include "src/lib/object_arena.h"
+#include "src/lib/numa.h"
+#include "src/lib/probes.h"
+#include "src/lib/query_trace.h"
+#include "src/page_profile.h"
 #include "src/lib/debug.h"
 
 #include "src/codesearch.h"
@@ -42,11 +47,15 @@ using re2::RE2;
 using re2::StringPiece;
 using namespace std;
 
-const int    kContextLines = 3;
-
 const size_t kMinSkip = 250;
 const int kMinFilterRatio = 50;
 const int kMaxScan        = (1 << 20);
+// Results in flight between the search threads and the caller; workers
+// block once this many are waiting.
+const size_t kResultQueueSize = 1024;
+// The most matches a thread counts locally before adding them to its
+// query's total.
+const int kMaxMatchBatch = 64;
 
 DEFINE_bool(index, true, "Create a suffix-array index to speed searches.");
 DEFINE_bool(compress, true, "Compress file contents linewise");
@@ -55,6 +64,36 @@ DEFINE_bool(search, true, "Actually do the search.");
 DEFINE_int32(timeout, 1000, "The number of milliseconds a single search may run for.");
 DEFINE_int32(threads, 4, "Number of threads to use.");
 DEFINE_int32(line_limit, 1024, "Maximum line length to index.");
+DEFINE_bool(line_postings, false, "Record exactly which files and lines contain each indexed line.");
+DEFINE_bool(line_directory, false, "Build a per-chunk newline directory for constant-time line lookups.");
+DEFINE_bool(thread_regex, true, "Give each search thread its own compiled copy of the query's regexes.");
+DEFINE_int64(thread_regex_max_mem, 8 << 20, "RE2 memory budget, in bytes, for each search thread's copy of a regex.");
+DEFINE_bool(inline_search, true, "Run highly selective queries on the calling thread.");
+DEFINE_double(inline_max_selectivity, 1e-8, "Largest estimated index selectivity for which a query is run inline.");
+DEFINE_int32(inline_max_candidates, 1000, "Hand an inline query to the search threads once it has probed this many index candidates.");
+DEFINE_bool(numa, false, "Spread chunks across NUMA nodes and give each node search threads that prefer its chunks.");
+DEFINE_int32(prefetch_chunks, 0, "Have a search that scans chunk data read this many chunks ahead of the search threads, for indexes that do not fit in memory.");
+DEFINE_int32(prefetch_sa_levels, 10, "With --prefetch_chunks, have an indexed search read ahead only the suffix-array pages the first this many steps of a binary search land on.");
+DEFINE_bool(residency_order, false, "Search the chunks of a mapped index that are in memory first; with --prefetch_chunks, read in the rest as the search threads near them.");
+DEFINE_bool(order_chunks, false, "Estimate each chunk's candidates before a search and visit the promising chunks first, spread across the index.");
+
+metric search_inline("search.inline");
+metric search_inline_handoff("search.inline_handoff");
+metric search_chunks_queued("search.chunks_queued", metric::kGauge);
+
+namespace {
+    std::shared_ptr<RE2> copy_regex(const std::shared_ptr<RE2> &re) {
+        if (!re)
+            return re;
+        RE2::Options opts(re->options());
+        opts.set_max_mem(FLAGS_thread_regex_max_mem);
+        std::shared_ptr<RE2> copy(new RE2(re->pattern(), opts));
+        // A smaller budget may not fit the program; share the original.
+        if (!copy->ok())
+            return re;
+        return copy;
+    }
+};
 
 namespace {
     metric idx_bytes("index.bytes");
@@ -111,16 +150,34 @@ const StringPiece empty_string(NULL, 0);
 
 class search_limiter {
 public:
-    search_limiter(int query_max_matches) : matches_(0), max_matches_(query_max_matches), exit_reason_(kExitNone) {
-        if (FLAGS_timeout <= 0) {
-            deadline_.tv_sec = numeric_limits<time_t>::max();
-        } else {
-            timeval timeout = {
-                0, FLAGS_timeout * 1000
-            }, now;
-            gettimeofday(&now, NULL);
-            timeval_add(&deadline_, &now, &timeout);
-        }
+    /*
+     * A thread's share of the match count. Threads add their matches to
+     * the shared total in batches, which shrink as the total nears
+     * max_matches so that the limit still trips on time.
+     */
+    struct local_count {
+        int pending;
+        int batch;
+        local_count() : pending(0), batch(1) {}
+    };
+
+    enum work_kind {
+        kWorkScanBytes,
+        kWorkCandidates,
+        kWorkTryMatches,
+        kWorkKinds
+    };
+
+    search_limiter(const query &q) : matches_(0), max_matches_(q.max_matches), exit_reason_(kExitNone) {
+        budget_[kWorkScanBytes] = q.budget.scan_bytes;
+        budget_[kWorkCandidates] = q.budget.candidates;
+        budget_[kWorkTryMatches] = q.budget.try_matches;
+        for (int i = 0; i < kWorkKinds; i++)
+            work_[i] = 0;
+        if (FLAGS_timeout <= 0)
+            deadline_ = numeric_limits<int64_t>::max();
+        else
+            deadline_ = coarse_monotonic_ns() + int64_t(FLAGS_timeout) * 1000000;
     }
 
     exit_reason why() {
@@ -128,39 +185,92 @@ public:
     }
 
     bool exit_early() {
-        if (exit_reason_)
+        if (exit_reason_.load(std::memory_order_relaxed))
             return true;
-
-#ifdef CODESEARCH_SLOWGTOD
-        static int counter = 1000;
-        if (--counter)
-            return false;
-        counter = 1000;
-#endif
-        timeval now;
-        gettimeofday(&now, NULL);
-        if (now.tv_sec > deadline_.tv_sec ||
-            (now.tv_sec == deadline_.tv_sec && now.tv_usec > deadline_.tv_usec)) {
-            exit_reason_ = kExitTimeout;
+        if (coarse_monotonic_ns() > deadline_) {
+            set_reason(kExitTimeout);
             return true;
         }
         return false;
     }
 
-    void record_match() {
-        int matches = ++matches_;
-        if (exit_reason_)
-            return;
-        if (max_matches_ && matches >= max_matches_) {
-            exit_reason_ = kExitMatchLimit;
+    void record_match(local_count *local) {
+        if (++local->pending >= local->batch)
+            add(local);
+    }
+
+    // Add whatever `local' has yet to report to the shared total.
+    void flush(local_count *local) {
+        if (local->pending)
+            add(local);
+    }
+
+    /*
+     * A thread's share of the work charged against the query's budgets.
+     * Like local_count, it reaches the shared totals in batches that
+     * shrink as a total nears its budget.
+     */
+    struct local_work {
+        int64_t pending[kWorkKinds];
+        int64_t batch[kWorkKinds];
+        local_work() {
+            for (int i = 0; i < kWorkKinds; i++) {
+                pending[i] = 0;
+                batch[i] = 1;
+            }
         }
+    };
+
+    /*
+     * Charge `n' units of `kind' work to the query. Returns false, and
+     * ends the search, once the total is over the query's budget. The
+     * caller counts the work itself; this only keeps the totals that
+     * budgets are checked against, so it costs nothing without one.
+     */
+    bool charge(work_kind kind, int64_t n, local_work *local) {
+        if (!budget_[kind])
+            return true;
+        if ((local->pending[kind] += n) < local->batch[kind])
+            return true;
+        return add(kind, local);
     }
 
 protected:
+    bool add(work_kind kind, local_work *local) {
+        int64_t total = (work_[kind] += local->pending[kind]);
+        local->pending[kind] = 0;
+        if (total > budget_[kind]) {
+            set_reason(kExitWorkLimit);
+            return false;
+        }
+        local->batch[kind] = max<int64_t>(1, (budget_[kind] - total) / (2 * FLAGS_threads));
+        return true;
+    }
+
+    void add(local_count *local) {
+        int matches = (matches_ += local->pending);
+        local->pending = 0;
+        if (!max_matches_) {
+            local->batch = kMaxMatchBatch;
+            return;
+        }
+        if (matches >= max_matches_)
+            set_reason(kExitMatchLimit);
+        local->batch = max(1, min(kMaxMatchBatch,
+                                  (max_matches_ - matches) / (2 * FLAGS_threads)));
+    }
+
+    void set_reason(exit_reason why) {
+        exit_reason none = kExitNone;
+        exit_reason_.compare_exchange_strong(none, why);
+    }
+
     atomic_int matches_;
     int max_matches_;
-    timeval deadline_;
-    exit_reason exit_reason_;
+    int64_t deadline_;
+    std::atomic<exit_reason> exit_reason_;
+    int64_t budget_[kWorkKinds];
+    std::atomic<int64_t> work_[kWorkKinds];
 };
 
 class code_searcher;
@@ -193,10 +303,11 @@ bool accept(const query *q, const indexed_file *file) {
     return true;
 }
 
-bool accept(const query *q, const list<indexed_file *> &sfs) {
-    for (list<indexed_file *>::const_iterator it = sfs.begin();
-         it != sfs.end(); ++it) {
-        if (accept(q, *it))
+bool accept(const query *q, const file_table &files,
+            const chunk *chunk, const chunk_range &r) {
+    const uint32_t *nos = chunk->range_files + r.first;
+    for (uint32_t i = 0; i < r.count; ++i) {
+        if (accept(q, files[nos[i]]))
             return true;
     }
     return false;
@@ -208,17 +319,21 @@ public:
              const query &q,
              const intrusive_ptr<IndexKey> index_key,
              const code_searcher::search_thread::transform_func& func) :
-        cc_(cc), query_(&q), transform_(func), queue_(),
-        limiter_(q.max_matches), index_key_(index_key), re2_time_(false),
+        cc_(cc), query_(&q), transform_(func), queue_(kResultQueueSize),
+        limiter_(q), index_key_(index_key), re2_time_(false),
         git_time_(false), index_time_(false), sort_time_(false),
         analyze_time_(false), files_(new uint8_t[cc->files_.size()]),
-        files_density_(-1)
+        files_density_(-1),
+        queue_wait_us_(0),
+        profile_(cc->page_profile_.load()), trace_(q.trace)
     {
         memset(files_, 0xff, cc->files_.size());
     }
 
     ~searcher() {
         delete[] files_;
+        for (auto it = arenas_.begin(); it != arenas_.end(); ++it)
+            object_arena<match_result>::put(*it);
 
         debug(kDebugProfile, "re2 time: %d.%06ds",
               int(re2_time_.elapsed().tv_sec),
@@ -236,6 +351,67 @@ public:
 
     void operator()(const chunk *chunk);
 
+    /*
+     * Bracket the calling thread's work on this search. With
+     * --thread_regex, the thread gets its own copy of the query's
+     * regexes in between: RE2 serializes threads on each regex's
+     * lazily-built DFA cache, and when a shared DFA runs out of memory
+     * every thread using it pays for the reset.
+     *
+     * If `results' is given, the thread is searching inline: its
+     * matches are appended to `results' instead of being posted to
+     * queue_.
+     *
+     * Each thread allocates its match_results from its own arena,
+     * which lives until the searcher does.
+     */
+    void enter_thread(vector<match_result*> *results = NULL);
+    void exit_thread();
+
+    // The calling thread's counters; it must be between enter_thread()
+    // and exit_thread().
+    work_counters &work() {
+        return thread_->work;
+    }
+
+    // Count `n' units of `kind' work for the calling thread, and charge
+    // them to the query's budget; false once that is spent.
+    bool charge(search_limiter::work_kind kind, int64_t n) {
+        work_counters &counts = work();
+        switch (kind) {
+        case search_limiter::kWorkScanBytes:
+            counts.scan_bytes += n;
+            break;
+        case search_limiter::kWorkCandidates:
+            counts.candidates += n;
+            break;
+        default:
+            counts.try_matches += n;
+            break;
+        }
+        return limiter_.charge(kind, n, &thread_->budgeted);
+    }
+
+    /*
+     * Reorder `chunks' for --order_chunks, so that a search cut short
+     * by its deadline or match limit has spent its time on the chunks
+     * likeliest to match, and has sampled them from across the whole
+     * index rather than only its first trees.
+     */
+    void order_chunks(vector<chunk*> *chunks);
+
+    // Whether searching a chunk reads all of its data, rather than
+    // probing its suffix array.
+    bool scans_chunks() const {
+        return !(FLAGS_index && index_key_ && !index_key_->empty());
+    }
+
+    // The number of index candidates the calling thread has examined
+    // since enter_thread().
+    long thread_candidates() const {
+        return thread_->work.candidates;
+    }
+
     void get_stats(match_stats *stats) {
         struct timeval t;
 
@@ -253,6 +429,21 @@ public:
 
         t = analyze_time_.elapsed();
         timeradd(&stats->analyze_time, &t, &stats->analyze_time);
+
+
+        {
+            std::unique_lock<std::mutex> locked(mtx_);
+            stats->work.add(work_);
+        }
+        long wait = queue_wait_us_;
+        t = (struct timeval){wait / 1000000, wait % 1000000};
+        timeradd(&stats->queue_wait, &t, &stats->queue_wait);
+    }
+
+    // Called by a search thread as it starts on its first chunk of a
+    // job queued at `queued'.
+    void record_queue_wait(int64_t queued) {
+        queue_wait_us_ += (monotonic_ns() - queued) / 1000;
     }
 
     exit_reason why() {
@@ -260,6 +451,12 @@ public:
     }
 
 protected:
+    // The query as seen by the calling thread.
+    const query *thread_query() const {
+        thread_state *st = thread_.get();
+        return st ? &st->q : query_;
+    }
+
     void next_range(match_finger *finger, int& minpos, int& maxpos, int end);
     bool should_search_chunk(const chunk *chunk);
     void full_search(const chunk *chunk);
@@ -277,15 +474,16 @@ protected:
         int hits = 0;
         int sample = min(1000, int(cc_->files_.size()));
         for (int i = 0; i < sample; i++) {
-            if (accept(query_, cc_->files_[rand() % cc_->files_.size()]))
+            if (accept(thread_query(), cc_->files_[rand() % cc_->files_.size()]))
                 hits++;
         }
         return (files_density_ = double(hits) / sample);
     }
 
     /*
-     * Do a linear walk over chunk->files, searching for all files
-     * which contain `match', which is contained within `line'.
+     * Scan every entry of chunk->ranges for those covering `line', and
+     * search the files range_files lists for each of them for `match',
+     * which is contained within `line'.
      */
     void find_match_brute(const chunk *chunk,
                           const StringPiece& match,
@@ -293,24 +491,76 @@ protected:
 
     /*
      * Given a match `match', contained within `line', find all files
-     * that contain that match. If indexing is enabled, do this by
-     * walking the chunk_file BST; Otherwise, fall back on a
-     * brute-force linear walk.
+     * that contain that match. With line postings, look them up;
+     * otherwise, if indexing is enabled, descend the implicit interval
+     * tree that chunk->ranges and range_limits form, and fall back on
+     * a scan of chunk->ranges if not.
      */
     void find_match(const chunk *chunk,
                     const StringPiece& match,
                     const StringPiece& line);
 
+    /*
+     * Given a match `match', contained within `line', and the
+     * candidate files whose ranges cover `line', post results for
+     * each accepted file that actually contains it. Files are visited
+     * in order of file number, so that a line shared by many files
+     * yields the same results no matter how the work was split.
+     */
+    void match_files(vector<indexed_file *> &files,
+                     const StringPiece& match,
+                     const StringPiece& line);
+
+    // Append the files holding range `r' of `chunk' to `out'.
+    void add_range_files(const chunk *chunk, const chunk_range &r,
+                         vector<indexed_file *> *out) {
+        if (profile_)
+            profile_->touch(chunk, page_profile::kRanges,
+                            (sizeof(chunk_range) + sizeof(uint32_t)) * chunk->nranges +
+                            sizeof(uint32_t) * r.first, sizeof(uint32_t) * r.count);
+        const uint32_t *nos = chunk->range_files + r.first;
+        for (uint32_t i = 0; i < r.count; ++i)
+            out->push_back(cc_->files_[nos[i]]);
+    }
+
+    /*
+     * Like find_match, but look up exactly which files and lines hold
+     * `line' in the chunk's line_postings.
+     */
+    void find_match_postings(const chunk *chunk,
+                             const StringPiece& match,
+                             const StringPiece& line);
+
+    /*
+     * Determine whether `sf' contains `line', by comparing pointers
+     * against its pieces only.
+     */
+    bool contains_line(indexed_file *sf, const StringPiece& line);
+
     /*
      * Given a matching substring, its containing line, and a search
      * file, determine whether that file actually contains that line,
-     * and if so, post results to queue_
+     * and if so, post results to queue_. Returns whether the line was
+     * found.
      */
-    void try_match(const StringPiece&,
+    bool try_match(const StringPiece&,
                    const StringPiece&,
-                   indexed_file *);
+                   indexed_file *,
+                   int more_files);
+
+    /*
+     * Build a match_result for `line' at line `lno' of `sf', where
+     * `it' is the piece holding it, and post it to queue_.
+     */
+    void post_match(const StringPiece& line,
+                    const StringPiece& match,
+                    indexed_file *sf, int lno,
+                    file_contents::iterator it,
+                    int more_files);
 
     static int line_start(const chunk *chunk, int pos) {
+        if (chunk->lines)
+            return chunk->lines->newline_before(pos);
         const unsigned char *start = static_cast<const unsigned char*>
             (memrchr(chunk->data, '\n', pos));
         if (start == NULL)
@@ -319,6 +569,8 @@ protected:
     }
 
     static int line_end(const chunk *chunk, int pos) {
+        if (chunk->lines)
+            return chunk->lines->newline_after(pos);
         const unsigned char *end = static_cast<const unsigned char*>
             (memchr(chunk->data + pos, '\n', chunk->size - pos));
         if (end == NULL)
@@ -345,10 +597,22 @@ protected:
         return StringPiece(start, end - start);
     }
 
+    static StringPiece find_line(const chunk *chunk, const StringPiece& match) {
+        StringPiece str((char*)chunk->data, chunk->size);
+        if (!chunk->lines)
+            return find_line(str, match);
+        // `match' never spans a newline, so the line holding its start
+        // also holds its end.
+        uint32_t id = chunk->lines->rank(match.data() - str.data());
+        uint32_t start = id ? chunk->lines->select(id - 1) + 1 : 0;
+        uint32_t end = chunk->lines->select(id);
+        return StringPiece(str.data() + start, end - start);
+    }
+
     const code_searcher *cc_;
     const query *query_;
     const code_searcher::search_thread::transform_func transform_;
-    thread_queue<match_result*> queue_;
+    bounded_queue<match_result*> queue_;
     search_limiter limiter_;
     intrusive_ptr<IndexKey> index_key_;
     timer re2_time_;
@@ -365,6 +629,24 @@ protected:
      */
     double files_density_;
     std::mutex mtx_;
+    // The counters of threads that have exited. Protected by mtx_.
+    work_counters work_;
+
+    struct thread_state {
+        query q;
+        vector<match_result*> *results;
+        object_arena<match_result> *arena;
+        search_limiter::local_count matches;
+        search_limiter::local_work budgeted;
+        work_counters work;
+    };
+    per_thread<thread_state> thread_;
+    // Arenas of threads that have finished; protected by mtx_.
+    vector<object_arena<match_result>*> arenas_;
+    std::atomic_long queue_wait_us_;
+    // NULL unless code_searcher::enable_page_profile() was called.
+    page_profile *profile_;
+    query_trace *trace_;
 
     friend class code_searcher::search_thread;
 };
@@ -374,11 +656,25 @@ public:
     filename_searcher(const code_searcher *cc,
                       const query &q,
                       intrusive_ptr<IndexKey> index_key) :
-        cc_(cc), query_(&q), index_key_(index_key), queue_(), limiter_(q.max_matches)
+        cc_(cc), query_(&q), index_key_(index_key), queue_(kResultQueueSize),
+        results_(0), arena_(object_arena<file_result>::get()),
+        limiter_(q)
     {}
 
+    ~filename_searcher() {
+        object_arena<file_result>::put(arena_);
+    }
+
     void operator()();
 
+    // Run the search on the calling thread, appending matches to
+    // `results' instead of posting them to queue_.
+    void operator()(vector<file_result*> *results) {
+        results_ = results;
+        (*this)();
+        results_ = 0;
+    }
+
     exit_reason why() {
         return limiter_.why();
     }
@@ -389,17 +685,23 @@ protected:
     const code_searcher *cc_;
     const query *query_;
     intrusive_ptr<IndexKey> index_key_;
-    thread_queue<file_result*> queue_;
+    bounded_queue<file_result*> queue_;
+    vector<file_result*> *results_;
+    object_arena<file_result> *arena_;
     search_limiter limiter_;
+    search_limiter::local_count matches_;
 
     friend class code_searcher::search_thread;
 };
 
+// With a `profile', the pages read are counted against `chunk'.
 int suffix_search(const unsigned char *data,
-                  uint32_t *suffixes,
+                  const uint32_t *suffixes,
                   int size,
                   intrusive_ptr<IndexKey> index,
-                  vector<uint32_t> &indexes_out);
+                  vector<uint32_t> &indexes_out,
+                  page_profile *profile = NULL,
+                  const chunk *chunk = NULL);
 
 void filename_searcher::operator()()
 {
@@ -427,26 +729,22 @@ void filename_searcher::operator()()
     // be done more cleverly in something like O(candidate_matches + log(indexed_files))
 
     // moving the left bound as we go isn't a big-O improvement, but may help a little bit.
-    auto left_bound = cc_->filename_positions_.begin();
+    const uint32_t *left_bound = cc_->filename_offsets_;
+    const uint32_t *end = cc_->filename_offsets_ + cc_->files_.size();
 
     for (int i = 0; i < count; i++) {
         if (limiter_.exit_early()) {
             break;
         }
 
-        int target_index = (*indexes)[i];
-        pair<int, indexed_file*> target(target_index, NULL);
-        auto lb = lower_bound(left_bound, cc_->filename_positions_.end(), target);
-
-        if (lb->first != target_index) {
-            assert(lb == cc_->filename_positions_.end() ||
-                   lb->first > target_index);
-            assert(lb != left_bound);
-            lb--;
-        }
-        assert(lb->first <= (*indexes)[i]);
-        assert((*indexes)[i] < lb->first + lb->second->path.size());
-        match_filename(lb->second);
+        uint32_t target_index = (*indexes)[i];
+        const uint32_t *lb = upper_bound(left_bound, end, target_index);
+        assert(lb != left_bound);
+        lb--;
+        indexed_file *file = cc_->files_[lb - cc_->filename_offsets_];
+        assert(*lb <= target_index);
+        assert(target_index < *lb + file->path.size() + 1);
+        match_filename(file);
 
         left_bound = lb;
     }
@@ -462,17 +760,23 @@ void filename_searcher::match_filename(indexed_file *file) {
                                  RE2::UNANCHORED, &match, 1))
         return;
 
-    file_result *f = new file_result;
+    file_result *f = arena_->alloc();
     f->file = file;
     f->matchleft = utf8::distance(filepath.data(), match.data());
     f->matchright = f->matchleft + utf8::distance(match.data(), match.data() + match.size());
 
-    queue_.push(f);
-    limiter_.record_match();
+    if (results_)
+        results_->push_back(f);
+    else
+        queue_.push(f);
+    limiter_.record_match(&matches_);
 }
 
 code_searcher::code_searcher()
-    : alloc_(0), finalized_(false), filename_data_(NULL), filename_suffixes_(NULL)
+    : alloc_(0), finalized_(false), ready_chunks_(0), total_chunks_(0),
+      warm_(true), page_profile_(NULL),
+      filename_data_(NULL), filename_data_size_(0),
+      filename_suffixes_(NULL), filename_offsets_(NULL)
 {
 #ifdef USE_DENSE_HASH_SET
     lines_.set_empty_key(empty_string);
@@ -484,7 +788,14 @@ void code_searcher::set_alloc(chunk_allocator *alloc) {
     alloc_ = alloc;
 }
 
+void code_searcher::enable_page_profile(const string& path, int interval) {
+    assert(finalized_ && ready_chunks() == total_chunks());
+    if (!page_profile_.load())
+        page_profile_.store(new page_profile(this, path, interval));
+}
+
 code_searcher::~code_searcher() {
+    delete page_profile_.load();
     if (alloc_)
         alloc_->cleanup();
     delete alloc_;
@@ -494,59 +805,75 @@ code_searcher::~code_searcher() {
         }
         delete tree;
     }
-    for (auto file : files_) {
+}
+
+file_table::~file_table() {
+    for (auto file : owned_)
         delete file;
-    }
-    if (filename_data_ != NULL) {
-        delete[] filename_data_;
-    }
-    if (filename_suffixes_ != NULL) {
-        delete[] filename_suffixes_;
+    if (mapped_) {
+        for (size_t i = 0; i < size_; i++)
+            delete mapped_[i].load(std::memory_order_relaxed);
+        free(mapped_);
     }
 }
 
 void code_searcher::index_filenames() {
     log("Building filename index...");
-    filename_positions_.reserve(files_.size());
+    filename_offsets_buf_.reserve(files_.size() + 1);
 
     filename_data_size_ = 0;
     for (auto it = files_.begin(); it != files_.end(); ++it) {
         filename_data_size_ += (*it)->path.size() + 1;
     }
 
-    filename_data_ = new unsigned char[filename_data_size_];
+    filename_data_buf_.resize(filename_data_size_);
+    unsigned char *data = filename_data_buf_.data();
     int offset = 0;
     for (auto it = files_.begin(); it != files_.end(); ++it) {
-        memcpy(filename_data_ + offset, (*it)->path.data(), (*it)->path.size());
-        filename_data_[offset + (*it)->path.size()] = '\0';
-        filename_positions_.emplace_back(offset, *it);
+        memcpy(data + offset, (*it)->path.data(), (*it)->path.size());
+        data[offset + (*it)->path.size()] = '\0';
+        filename_offsets_buf_.push_back(offset);
         offset += (*it)->path.size() + 1;
     }
+    filename_offsets_buf_.push_back(offset);
 
-    filename_suffixes_ = new uint32_t[filename_data_size_];
-    divsufsort(filename_data_, reinterpret_cast<saidx_t*>(filename_suffixes_), filename_data_size_);
+    filename_suffixes_buf_.resize(filename_data_size_);
+    divsufsort(data, reinterpret_cast<saidx_t*>(filename_suffixes_buf_.data()), filename_data_size_);
+
+    filename_data_ = data;
+    filename_suffixes_ = filename_suffixes_buf_.data();
+    filename_offsets_ = filename_offsets_buf_.data();
 }
 
 void code_searcher::finalize() {
     assert(!finalized_);
     finalized_ = true;
+    // Before alloc_->finalize(), which may write out the index.
+    index_filenames();
     alloc_->finalize();
+    total_chunks_ = alloc_->size();
+    ready_chunks_.store(total_chunks_, std::memory_order_release);
 
     timeval now;
     gettimeofday(&now, NULL);
     index_timestamp_ = now.tv_sec;
 
-    index_filenames();
-
     idx_data_chunks.inc(alloc_->end() - alloc_->begin());
     idx_content_chunks.inc(alloc_->end_content() - alloc_->begin_content());
 }
 
 vector<indexed_tree> code_searcher::trees() const {
+    std::unique_lock<std::mutex> locked(tree_metadata_mtx_);
     vector<indexed_tree> out;
     out.reserve(trees_.size());
-    for (auto it = trees_.begin(); it != trees_.end(); ++it)
-        out.push_back(**it);
+    for (auto it = trees_.begin(); it != trees_.end(); ++it) {
+        indexed_tree *tree = *it;
+        if (!tree->metadata && !tree->metadata_json.empty()) {
+            tree->metadata = json_tokener_parse(tree->metadata_json.as_string().c_str());
+            assert(!is_error(tree->metadata));
+        }
+        out.push_back(*tree);
+    }
     return out;
 }
 
@@ -554,6 +881,7 @@ const indexed_tree* code_searcher::open_tree(const string &name,
                                              json_object *metadata,
                                              const string &version) {
     indexed_tree *tree = new indexed_tree;
+    tree->id = trees_.size();
     tree->name = name;
     tree->version = version;
     if (metadata) {
@@ -572,6 +900,7 @@ void code_searcher::index_file(const indexed_tree *tree,
     assert(!finalized_);
     assert(alloc_);
     size_t len = contents.size();
+    PROBE(index__file, tree->name.c_str(), path.c_str(), len);
     const char *p = contents.data();
     const char *end = p + len;
     const char *f;
@@ -595,10 +924,21 @@ void code_searcher::index_file(const indexed_tree *tree,
 
     // sf->content = new(new uint32_t[3*lines+1]) file_contents(0);
     file_contents_builder content;
+    // Postings name pieces of `content', so they are only added once
+    // it has been built.
+    struct pending_posting {
+        chunk *c;
+        StringPiece line;
+        int lno;
+        int piece;
+    };
+    vector<pending_posting> postings;
 
+    int lno = 0;
     while ((f = static_cast<const char*>(memchr(p, '\n', end - p))) != 0) {
     final:
         idx_lines.inc();
+        ++lno;
         if (f - p + 1 >= FLAGS_line_limit) {
             // Don't index the long line, but do index an empty
             // line so that line number of future lines are
@@ -635,6 +975,8 @@ void code_searcher::index_file(const indexed_tree *tree,
             c->add_chunk_file(sf, line);
         }
         content.extend(c, line);
+        if (FLAGS_line_postings)
+            postings.push_back({c, line, lno, int(content.size() - 1)});
         p = min(end, f + 1);
     }
     if (p < end - 1) {
@@ -652,6 +994,9 @@ void code_searcher::index_file(const indexed_tree *tree,
                 tree->name.c_str(), tree->version.c_str(), path.c_str());
         file_contents_builder dummy;
         sf->content = dummy.build(alloc_);
+    } else {
+        for (auto &p : postings)
+            p.c->add_posting(sf, p.line, p.lno, p.piece);
     }
     idx_content_ranges.inc(sf->content->size());
     assert(sf->content->size() <= 3*lines);
@@ -666,37 +1011,78 @@ void code_searcher::index_file(const indexed_tree *tree,
 }
 
 bool searcher::should_search_chunk(const chunk *chunk) {
-    if (!query_->tree_pat) {
+    const query *q = thread_query();
+    if (!q->tree_pat) {
         return true;
     }
 
     // skip chunks that don't contain any repos we're looking for
-    for (auto it = chunk->tree_names.begin(); it != chunk->tree_names.end(); it++) {
-        if (query_->tree_pat->Match(*it, 0,
-                                    it->size(),
-                                    RE2::UNANCHORED, 0, 0)) {
-            return true;
+    for (uint32_t w = 0; w < chunk->ntree_words; w++) {
+        for (uint64_t bits = chunk->tree_bits[w]; bits; bits &= bits - 1) {
+            const string &name = cc_->trees_[w * 64 + __builtin_ctzll(bits)]->name;
+            if (q->tree_pat->Match(name, 0,
+                                   name.size(),
+                                   RE2::UNANCHORED, 0, 0)) {
+                return true;
+            }
         }
     }
     return false;
 }
 
+void searcher::enter_thread(vector<match_result*> *results) {
+    thread_state *st = new thread_state;
+    st->q = *query_;
+    st->results = results;
+    st->arena = object_arena<match_result>::get();
+    if (FLAGS_thread_regex) {
+        st->q.line_pat = copy_regex(query_->line_pat);
+        st->q.file_pat = copy_regex(query_->file_pat);
+        st->q.tree_pat = copy_regex(query_->tree_pat);
+        st->q.negate.file_pat = copy_regex(query_->negate.file_pat);
+        st->q.negate.tree_pat = copy_regex(query_->negate.tree_pat);
+    }
+    delete thread_.put(st);
+}
+
+void searcher::exit_thread() {
+    thread_state *st = thread_.put(NULL);
+    assert(st);
+    limiter_.flush(&st->matches);
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        arenas_.push_back(st->arena);
+        work_.add(st->work);
+    }
+    delete st;
+}
+
 void searcher::operator()(const chunk *chunk)
 {
-    if (limiter_.exit_early())
-        return;
-
-    if (!should_search_chunk(chunk))
+    work_counters &work = this->work();
+    ++work.chunks_considered;
+    PROBE(chunk__start, chunk->id);
+    if (limiter_.exit_early() || !should_search_chunk(chunk)) {
+        ++work.chunks_skipped;
+        PROBE(chunk__done, chunk->id, kProbeChunkSkipped);
         return;
+    }
 
-    if (FLAGS_index && index_key_ && !index_key_->empty())
+    query_trace::span span(trace_, "chunk");
+    span.set("chunk", chunk->id);
+    if (FLAGS_index && index_key_ && !index_key_->empty() && chunk->suffixes) {
+        ++work.chunks_indexed;
         filtered_search(chunk);
-    else
+        PROBE(chunk__done, chunk->id, kProbeChunkIndexed);
+    } else {
+        ++work.chunks_scanned;
         full_search(chunk);
+        PROBE(chunk__done, chunk->id, kProbeChunkScanned);
+    }
 }
 
 struct walk_state {
-    uint32_t *left, *right;
+    const uint32_t *left, *right;
     intrusive_ptr<IndexKey> key;
     int depth;
 };
@@ -704,16 +1090,26 @@ struct walk_state {
 struct lt_index {
     const unsigned char *data_;
     int idx_;
+    // If set, probes are counted in profile_; suffixes_ is the start
+    // of the suffix array, so that we know where a probe landed.
+    page_profile *profile_;
+    const chunk *chunk_;
+    const uint32_t *suffixes_;
 
-    bool operator()(uint32_t lhs, unsigned char rhs) {
+    bool operator()(const uint32_t &lhs, unsigned char rhs) {
         return cmp(lhs, rhs) < 0;
     }
 
-    bool operator()(unsigned char lhs, uint32_t rhs) {
+    bool operator()(unsigned char lhs, const uint32_t &rhs) {
         return cmp(rhs, lhs) > 0;
     }
 
-    int cmp(uint32_t lhs, unsigned char rhs) {
+    int cmp(const uint32_t &lhs, unsigned char rhs) {
+        if (profile_) {
+            profile_->touch(chunk_, page_profile::kSuffixes,
+                            (&lhs - suffixes_) * sizeof(uint32_t));
+            profile_->touch(chunk_, page_profile::kData, lhs + idx_);
+        }
         unsigned char lc = data_[lhs + idx_];
         if (lc == '\n')
             return -1;
@@ -722,10 +1118,12 @@ struct lt_index {
 };
 
 int suffix_search(const unsigned char *data,
-                  uint32_t *suffixes,
+                  const uint32_t *suffixes,
                   int size,
                   intrusive_ptr<IndexKey> index,
-                  vector<uint32_t> &indexes_out) {
+                  vector<uint32_t> &indexes_out,
+                  page_profile *profile,
+                  const chunk *chunk) {
     int count = 0;
     vector<walk_state> stack;
     stack.push_back((walk_state){
@@ -741,17 +1139,21 @@ int suffix_search(const unsigned char *data,
             }
             memcpy(&indexes_out[count], st.left,
                    (st.right - st.left) * sizeof(uint32_t));
+            if (profile)
+                profile->touch(chunk, page_profile::kSuffixes,
+                               (st.left - suffixes) * sizeof(uint32_t),
+                               (st.right - st.left) * sizeof(uint32_t));
             count += (st.right - st.left);
             continue;
         }
-        lt_index lt = {data, st.depth};
+        lt_index lt = {data, st.depth, profile, chunk, suffixes};
         for (IndexKey::iterator it = st.key->begin();
              it != st.key->end(); ++it) {
-            uint32_t *l, *r;
+            const uint32_t *l, *r;
             l = lower_bound(st.left, st.right, it->first.first, lt);
-            uint32_t *right = lower_bound(l, st.right,
-                                          (unsigned char)(it->first.second + 1),
-                                          lt);
+            const uint32_t *right = lower_bound(l, st.right,
+                                                (unsigned char)(it->first.second + 1),
+                                                lt);
             if (l == right)
                 continue;
 
@@ -779,6 +1181,133 @@ int suffix_search(const unsigned char *data,
     return count;
 }
 
+/*
+ * An upper bound on the candidates suffix_search would return for
+ * `index', found by following it no deeper than `depth' characters.
+ * That costs a handful of binary searches per chunk.
+ */
+long estimate_candidates(const unsigned char *data,
+                         const uint32_t *suffixes,
+                         int size,
+                         intrusive_ptr<IndexKey> index,
+                         int depth,
+                         page_profile *profile = NULL,
+                         const chunk *chunk = NULL) {
+    long count = 0;
+    vector<walk_state> stack;
+    stack.push_back((walk_state){
+            suffixes, suffixes + size, index, 0});
+
+    while (!stack.empty()) {
+        walk_state st = stack.back();
+        stack.pop_back();
+        if (!st.key || st.key->empty() || st.depth >= depth) {
+            count += st.right - st.left;
+            continue;
+        }
+        lt_index lt = {data, st.depth, profile, chunk, suffixes};
+        for (IndexKey::iterator it = st.key->begin();
+             it != st.key->end(); ++it) {
+            const uint32_t *l, *r;
+            l = lower_bound(st.left, st.right, it->first.first, lt);
+            const uint32_t *right = lower_bound(l, st.right,
+                                                (unsigned char)(it->first.second + 1),
+                                                lt);
+            if (l == right)
+                continue;
+            if (st.depth + 1 >= depth) {
+                count += right - l;
+                continue;
+            }
+            for (unsigned char ch = it->first.first; ch <= it->first.second;
+                 ch++, l = r) {
+                r = lower_bound(l, right, (unsigned char)(ch + 1), lt);
+                if (r != l)
+                    stack.push_back((walk_state){l, r, it->second, st.depth + 1});
+            }
+        }
+    }
+    return count;
+}
+
+namespace {
+    // How deep estimate_candidates() follows the index key.
+    const int kOrderDepth = 2;
+    // Chunks with fewer estimated candidates than this cost about as
+    // much in fixed per-chunk work as in matching, and go after the
+    // denser ones.
+    const long kOrderDenseCandidates = 16;
+
+    // `i' with its low `bits' bits reversed. Visiting 0..2^bits-1 in
+    // this order keeps halving the gaps between the positions seen so
+    // far.
+    uint32_t spread_order(uint32_t i, int bits) {
+        uint32_t out = 0;
+        for (int b = 0; b < bits; ++b, i >>= 1)
+            out = (out << 1) | (i & 1);
+        return out;
+    }
+
+    struct chunk_order {
+        int tier;
+        uint32_t spread;
+        chunk *c;
+
+        bool operator<(const chunk_order &rhs) const {
+            if (tier != rhs.tier)
+                return tier < rhs.tier;
+            return spread < rhs.spread;
+        }
+    };
+};
+
+void searcher::order_chunks(vector<chunk*> *chunks) {
+    int bits = 0;
+    while ((size_t(1) << bits) < chunks->size())
+        ++bits;
+    bool estimate = FLAGS_index && index_key_ && !index_key_->empty();
+
+    vector<chunk_order> order;
+    order.reserve(chunks->size());
+    int tiers[3] = {0, 0, 0};
+    {
+        run_timer run(index_time_);
+        for (size_t i = 0; i < chunks->size(); ++i) {
+            chunk *c = (*chunks)[i];
+            /*
+             * Tier 0 holds the chunks worth searching first, tier 1
+             * the sparse ones, and tier 2 those that cannot match
+             * at all; those still get searched, but cost next to
+             * nothing.
+             */
+            int tier = 0;
+            if (!should_search_chunk(c)) {
+                tier = 2;
+            } else if (!c->suffixes) {
+                // A chunk without a suffix array costs a full scan; take it after the
+                // chunks the index says are promising.
+                tier = 1;
+            } else if (estimate) {
+                long n = estimate_candidates(c->data, c->suffixes, c->size,
+                                             index_key_, kOrderDepth, profile_, c);
+                if (n == 0)
+                    tier = 2;
+                else if (n < kOrderDenseCandidates)
+                    tier = 1;
+            }
+            ++tiers[tier];
+            order.push_back((chunk_order){
+                    tier, spread_order(i, bits), c});
+        }
+    }
+    sort(order.begin(), order.end());
+    for (size_t i = 0; i < order.size(); ++i)
+        (*chunks)[i] = order[i].c;
+
+    debug(kDebugProfile, "order chunks: %d dense, %d sparse, %d empty",
+          tiers[0], tiers[1], tiers[2]);
+}
+
 void searcher::filtered_search(const chunk *chunk)
 {
     static per_thread<vector<uint32_t> > indexes;
@@ -788,17 +1317,23 @@ void searcher::filtered_search(const chunk *chunk)
     int count;
     {
         run_timer run(index_time_);
-        count = suffix_search(chunk->data, chunk->suffixes, chunk->size, index_key_, *indexes);
+        query_trace::span span(trace_, "suffix_search");
+        count = suffix_search(chunk->data, chunk->suffixes, chunk->size, index_key_, *indexes,
+                              profile_, chunk);
+        span.set("candidates", count);
     }
+    PROBE(chunk__candidates, chunk->id, count);
+    if (!charge(search_limiter::kWorkCandidates, count))
+        return;
 
     search_lines(&(*indexes)[0], count, chunk);
 }
 
 struct match_finger {
     const chunk *chunk_;
-    vector<chunk_file>::const_iterator it_;
+    const chunk_range *it_;
     match_finger(const chunk *chunk) :
-        chunk_(chunk), it_(chunk->files.begin()) {};
+        chunk_(chunk), it_(chunk->ranges) {};
 };
 
 void searcher::search_lines(uint32_t *indexes, int count,
@@ -822,6 +1357,7 @@ void searcher::search_lines(uint32_t *indexes, int count,
 
     {
         run_timer run(sort_time_);
+        query_trace::span span(trace_, "sort");
         lsd_radix_sort(indexes, indexes + count);
     }
 
@@ -842,6 +1378,10 @@ void searcher::search_lines(uint32_t *indexes, int count,
         int end = line_end(chunk, max);
         full_search(&finger, chunk, min, end);
 
+        // Bucket the remaining candidates by line: any that fall on a
+        // line we just searched are already covered.
+        while (i < count && indexes[i] <= end)
+            i++;
         if (i != count) {
             max = indexes[i];
             min = line_start(chunk, max);
@@ -858,26 +1398,28 @@ void searcher::full_search(const chunk *chunk)
 void searcher::next_range(match_finger *finger,
                           int& pos, int& endpos, int maxpos)
 {
-    if ((!query_->file_pat && !query_->tree_pat) || !FLAGS_index)
+    const query *q = thread_query();
+    if ((!q->file_pat && !q->tree_pat) || !FLAGS_index)
         return;
 
     debug(kDebugSearch, "next_range(%d, %d, %d)", pos, endpos, maxpos);
 
-    vector<chunk_file>::const_iterator& it = finger->it_;
-    const vector<chunk_file>::const_iterator& end = finger->chunk_->files.end();
+    const chunk *chunk = finger->chunk_;
+    const chunk_range *&it = finger->it_;
+    const chunk_range *end = chunk->ranges + chunk->nranges;
 
     /* Find the first matching range that intersects [pos, maxpos) */
     while (it != end &&
-           (it->right < pos || !accept(query_, it->files)) &&
-           it->left < maxpos)
+           (int(it->right) < pos || !accept(q, cc_->files_, chunk, *it)) &&
+           int(it->left) < maxpos)
         ++it;
 
-    if (it == end || it->left >= maxpos) {
+    if (it == end || int(it->left) >= maxpos) {
         pos = endpos = maxpos;
         return;
     }
 
-    pos    = max(pos, it->left);
+    pos    = max(pos, int(it->left));
     endpos = it->right;
 
     /*
@@ -887,10 +1429,10 @@ void searcher::next_range(match_finger *finger,
      * - pass maxpos entirely.
      */
     do {
-        if (it->left >= endpos + kMinSkip)
+        if (int(it->left) >= endpos + kMinSkip)
             break;
-        if (it->right >= endpos && accept(query_, it->files)) {
-            endpos = max(endpos, it->right);
+        if (int(it->right) >= endpos && accept(q, cc_->files_, chunk, *it)) {
+            endpos = max(endpos, int(it->right));
             if (endpos >= maxpos)
                 /*
                  * We've accepted the entire range. No point in going on.
@@ -898,7 +1440,7 @@ void searcher::next_range(match_finger *finger,
                 break;
         }
         ++it;
-    } while (it != end && it->left < maxpos);
+    } while (it != end && int(it->left) < maxpos);
 
     endpos = min(endpos, maxpos);
 }
@@ -908,6 +1450,7 @@ void searcher::full_search(match_finger *finger,
 {
     StringPiece str((char*)chunk->data, chunk->size);
     StringPiece match;
+    const RE2 *line_pat = thread_query()->line_pat.get();
     int pos = minpos, new_pos, end = minpos;
     while (pos < maxpos && !limiter_.exit_early()) {
         if (pos >= end) {
@@ -925,16 +1468,26 @@ void searcher::full_search(match_finger *finger,
             int limit = end;
             if (limit - pos > kMaxScan)
                 limit = line_end(chunk, pos + kMaxScan);
+            if (profile_)
+                profile_->touch(chunk, page_profile::kData, pos, limit - pos);
             run_timer run(re2_time_);
-            if (!query_->line_pat->Match(str, pos, limit, RE2::UNANCHORED, &match, 1)) {
+            query_trace::span span(trace_, "re2");
+            span.set("bytes", limit - pos);
+            ++work().re2_calls;
+            if (!line_pat->Match(str, pos, limit, RE2::UNANCHORED, &match, 1)) {
+                charge(search_limiter::kWorkScanBytes, limit - pos);
                 pos = limit + 1;
                 continue;
             }
         }
         assert(memchr(match.data(), '\n', match.size()) == NULL);
-        StringPiece line = find_line(str, match);
-        if (utf8::is_valid(line.data(), line.data() + line.size()))
+        StringPiece line = find_line(chunk, match);
+        charge(search_limiter::kWorkScanBytes,
+               line.data() + line.size() - (str.data() + pos));
+        if (utf8::is_valid(line.data(), line.data() + line.size())) {
+            query_trace::span span(trace_, "find_match");
             find_match(chunk, match, line);
+        }
         new_pos = line.size() + line.data() - str.data() + 1;
         assert(new_pos > pos);
         pos = new_pos;
@@ -944,25 +1497,26 @@ void searcher::full_search(match_finger *finger,
 void searcher::find_match_brute(const chunk *chunk,
                                 const StringPiece& match,
                                 const StringPiece& line) {
+    static per_thread<vector<indexed_file *> > candidates;
+    if (!candidates.get())
+        candidates.put(new vector<indexed_file *>);
+
     run_timer run(git_time_);
     timer tm;
     int off = (unsigned char*)line.data() - chunk->data;
-    int searched = 0;
-
-    for(vector<chunk_file>::const_iterator it = chunk->files.begin();
-        it != chunk->files.end(); it++) {
-        if (off >= it->left && off <= it->right) {
-            for (list<indexed_file *>::const_iterator fit = it->files.begin();
-                 fit != it->files.end(); ++fit) {
-                if (!accept(query_, *fit))
-                    continue;
-                searched++;
-                if (limiter_.exit_early())
-                    break;
-                try_match(line, match, *fit);
-            }
-        }
+
+    candidates->clear();
+    if (profile_)
+        profile_->touch(chunk, page_profile::kRanges, 0,
+                        sizeof(chunk_range) * chunk->nranges);
+    work().find_match_nodes += chunk->nranges;
+    for (uint32_t i = 0; i < chunk->nranges; i++) {
+        const chunk_range &r = chunk->ranges[i];
+        if (off >= int(r.left) && off <= int(r.right))
+            add_range_files(chunk, r, candidates.get());
     }
+    int searched = candidates->size();
+    match_files(*candidates, match, line);
 
     tm.pause();
     debug(kDebugProfile, "Searched %d files in %d.%06ds",
@@ -974,128 +1528,284 @@ void searcher::find_match_brute(const chunk *chunk,
 void searcher::find_match(const chunk *chunk,
                           const StringPiece& match,
                           const StringPiece& line) {
+    if (chunk->postings) {
+        find_match_postings(chunk, match, line);
+        return;
+    }
+
     if (!FLAGS_index) {
         find_match_brute(chunk, match, line);
         return;
     }
 
+    static per_thread<vector<indexed_file *> > candidates;
+    if (!candidates.get())
+        candidates.put(new vector<indexed_file *>);
+
     run_timer run(git_time_);
     int loff = (unsigned char*)line.data() - chunk->data;
 
-    vector<chunk_file_node *> stack;
-    assert(chunk->cf_root);
-    stack.push_back(chunk->cf_root);
+    // Subtrees of the implicit interval tree, as [left, right) ranges
+    // of chunk->ranges.
+    vector<pair<uint32_t, uint32_t> > stack;
+    stack.push_back(make_pair(0u, chunk->nranges));
+    candidates->clear();
 
     debug(kDebugSearch, "find_match(%d)", loff);
 
-    while (!stack.empty() && !limiter_.exit_early()) {
-        chunk_file_node *n = stack.back();
+    long nodes = 0;
+    while (!stack.empty()) {
+        pair<uint32_t, uint32_t> n = stack.back();
         stack.pop_back();
+        if (n.first == n.second)
+            continue;
+        ++nodes;
+        uint32_t mid = (n.first + n.second) / 2;
+        const chunk_range &r = chunk->ranges[mid];
+        if (profile_) {
+            profile_->touch(chunk, page_profile::kRanges, sizeof(chunk_range) * mid);
+            profile_->touch(chunk, page_profile::kRanges,
+                            sizeof(chunk_range) * chunk->nranges + sizeof(uint32_t) * mid);
+        }
 
         debug(kDebugSearch,
-              "walk <%d-%d> - %d", n->chunk->left, n->chunk->right,
-              n->right_limit);
+              "walk <%d-%d> - %d", r.left, r.right, chunk->range_limits[mid]);
 
-        if (loff > n->right_limit)
+        if (loff > int(chunk->range_limits[mid]))
             continue;
-        if (loff >= n->chunk->left) {
-            if (n->right)
-                stack.push_back(n->right);
-            if (loff <= n->chunk->right) {
-                debug(kDebugSearch, "visit <%d-%d>", n->chunk->left, n->chunk->right);
-                assert(loff >= n->chunk->left && loff <= n->chunk->right);
-                for (list<indexed_file *>::const_iterator it = n->chunk->files.begin();
-                     it != n->chunk->files.end(); ++it) {
-                    if (!accept(query_, *it))
-                        continue;
-                    if (limiter_.exit_early())
-                        break;
-                    try_match(line, match, *it);
-                }
+        if (loff >= int(r.left)) {
+            stack.push_back(make_pair(mid + 1, n.second));
+            if (loff <= int(r.right)) {
+                debug(kDebugSearch, "visit <%d-%d>", r.left, r.right);
+                add_range_files(chunk, r, candidates.get());
+            }
+        }
+        stack.push_back(make_pair(n.first, mid));
+    }
+    work().find_match_nodes += nodes;
+
+    match_files(*candidates, match, line);
+}
+
+void searcher::match_files(vector<indexed_file *> &files,
+                           const StringPiece& match,
+                           const StringPiece& line) {
+    sort(files.begin(), files.end(),
+         [](const indexed_file *lhs, const indexed_file *rhs) {
+             return lhs->no < rhs->no;
+         });
+    // A file comes once for each of its ranges that covers the line;
+    // try it, and count it against max_files_per_line, only once.
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+
+    PROBE(try__match__batch, files.size());
+    const query *q = thread_query();
+    int limit = q->max_files_per_line, found = 0;
+    for (auto it = files.begin(); it != files.end(); ++it) {
+        if (limiter_.exit_early())
+            return;
+        if (!accept(q, *it))
+            continue;
+        if (!limit || found < limit - 1) {
+            if (try_match(line, match, *it, 0))
+                found++;
+            continue;
+        }
+
+        // This is the last file we will report for this line; count
+        // the remaining ones so the result can say how many we left
+        // out.
+        if (!contains_line(*it, line))
+            continue;
+        int more = 0;
+        for (auto rest = it + 1; rest != files.end(); ++rest) {
+            if (limiter_.exit_early())
+                break;
+            if (accept(q, *rest) && contains_line(*rest, line))
+                more++;
+        }
+        try_match(line, match, *it, more);
+        return;
+    }
+}
+
+void searcher::find_match_postings(const chunk *chunk,
+                                   const StringPiece& match,
+                                   const StringPiece& line) {
+    static per_thread<vector<line_posting> > postings;
+    if (!postings.get())
+        postings.put(new vector<line_posting>);
+
+    run_timer run(git_time_);
+    int id = chunk->postings->line_id((unsigned char*)line.data() - chunk->data);
+    assert(id >= 0);
+    postings->clear();
+    chunk->postings->decode(id, postings.get());
+    PROBE(try__match__batch, postings->size());
+
+    const query *q = thread_query();
+    int limit = q->max_files_per_line, found = 0;
+    auto it = postings->begin(), end = postings->end();
+    while (it != end) {
+        if (limiter_.exit_early())
+            return;
+        auto next = it;
+        while (next != end && next->file == it->file)
+            ++next;
+        indexed_file *sf = cc_->files_[it->file];
+        if (!accept(q, sf)) {
+            it = next;
+            continue;
+        }
+
+        int more = 0;
+        if (limit && found == limit - 1) {
+            for (auto rest = next; rest != end; ++rest) {
+                if (rest->file == (rest - 1)->file)
+                    continue;
+                if (limiter_.exit_early())
+                    break;
+                if (accept(q, cc_->files_[rest->file]))
+                    more++;
             }
         }
-        if (n->left)
-            stack.push_back(n->left);
+        work().files_tried++;
+        work().files_accepted++;
+        for (; it != next && !limiter_.exit_early(); ++it) {
+            if (!charge(search_limiter::kWorkTryMatches, 1))
+                return;
+            post_match(line, match, sf, it->lno,
+                       sf->content->at(cc_->alloc_, it->piece), more);
+            more = 0;
+        }
+        if (limit && ++found == limit)
+            return;
+        it = next;
     }
 }
 
+bool searcher::contains_line(indexed_file *sf, const StringPiece& line) {
+    for (auto it = sf->content->begin(); it != sf->content->end(); ++it) {
+        const char *data = reinterpret_cast<const char*>
+            (cc_->alloc_->at(it->chunk)->data + it->off);
+        if (line.data() >= data && line.data() <= data + it->len)
+            return true;
+    }
+    return false;
+}
 
-void searcher::try_match(const StringPiece& line,
+bool searcher::try_match(const StringPiece& line,
                          const StringPiece& match,
-                         indexed_file *sf) {
+                         indexed_file *sf,
+                         int more_files) {
+    if (!charge(search_limiter::kWorkTryMatches, 1))
+        return false;
+    query_trace::span span(trace_, "try_match");
+    if (profile_)
+        profile_->touch_content(sf->content, sizeof(uint32_t) +
+                                sf->content->size() * sizeof(file_contents::piece));
 
+    work_counters &work = this->work();
+    ++work.files_tried;
     int lno = 1;
+    bool found = false;
     auto it = sf->content->begin(cc_->alloc_);
+    // `lno' is the line number at the start of `counted'. We only
+    // count newlines once we have found a piece containing `line', so
+    // candidate files that turn out not to contain it cost nothing
+    // but pointer comparisons.
+    auto counted = it;
 
     while (true) {
         for (;it != sf->content->end(cc_->alloc_); ++it) {
+            ++work.pieces_walked;
             if (line.data() >= it->data() &&
-                line.data() <= it->data() + it->size()) {
-                lno += count(it->data(), line.data(), '\n');
+                line.data() <= it->data() + it->size())
                 break;
-            } else {
-                lno += count(it->data(), it->data() + it->size(), '\n') + 1;
-            }
         }
 
-        debug(kDebugSearch, "found match on %s:%d", sf->path.c_str(), lno);
-
         if (it == sf->content->end(cc_->alloc_))
-            return;
+            return found;
 
-        match_result *m = new match_result;
-        m->file = sf;
-        m->lno  = lno;
-        m->line = line;
-        m->matchleft = utf8::distance(line.data(), match.data());
-        m->matchright = m->matchleft +
-            utf8::distance(match.data(), match.data() + match.size());
-
-        // iterators for forward and backward context
-        auto fit = it, bit = it;
-        StringPiece l = line;
-        int i = 0;
-
-        for (i = 0; i < kContextLines; i++) {
-            if (l.data() == bit->data()) {
-                if (bit == sf->content->begin(cc_->alloc_))
-                    break;
-                --bit;
-                l = StringPiece(bit->data() + bit->size() + 1, 0);
-            }
-            l = find_line(*bit, StringPiece(l.data() - 1, 0));
-            m->context_before.push_back(l);
-        }
+        for (; counted != it; ++counted)
+            lno += count(counted->data(), counted->data() + counted->size(), '\n') + 1;
 
-        l = line;
+        if (!found)
+            ++work.files_accepted;
+        found = true;
+        post_match(line, match, sf, lno + count(it->data(), line.data(), '\n'),
+                   it, more_files);
+        if (limiter_.exit_early())
+            break;
 
-        for (i = 0; i < kContextLines; i++) {
-            if (l.data() + l.size() == fit->data() + fit->size()) {
-                if (++fit == sf->content->end(cc_->alloc_))
-                    break;
-                l = StringPiece(fit->data() - 1, 0);
-            }
-            l = find_line(*fit, StringPiece(l.data() + l.size() + 1, 0));
-            m->context_after.push_back(l);
+        more_files = 0;
+        ++it;
+    }
+    return found;
+}
+
+void searcher::post_match(const StringPiece& line,
+                          const StringPiece& match,
+                          indexed_file *sf, int lno,
+                          file_contents::iterator it,
+                          int more_files) {
+    assert(line.data() >= it->data() &&
+           line.data() <= it->data() + it->size());
+    debug(kDebugSearch, "found match on %s:%d", sf->path.c_str(), lno);
+
+    thread_state *st = thread_.get();
+    assert(st);
+    match_result *m = st->arena->alloc();
+    m->file = sf;
+    m->lno  = lno;
+    m->line = line;
+    m->matchleft = utf8::distance(line.data(), match.data());
+    m->matchright = m->matchleft +
+        utf8::distance(match.data(), match.data() + match.size());
+    m->more_files = more_files;
+
+    // iterators for forward and backward context
+    auto fit = it, bit = it;
+    StringPiece l = line;
+    int i = 0;
+
+    for (i = 0; i < kContextLines; i++) {
+        if (l.data() == bit->data()) {
+            if (bit == sf->content->begin(cc_->alloc_))
+                break;
+            --bit;
+            l = StringPiece(bit->data() + bit->size() + 1, 0);
         }
+        l = find_line(*bit, StringPiece(l.data() - 1, 0));
+        m->context_before.push_back(l);
+    }
 
-        if (!transform_ || transform_(m)) {
-            queue_.push(m);
-            limiter_.record_match();
+    l = line;
+
+    for (i = 0; i < kContextLines; i++) {
+        if (l.data() + l.size() == fit->data() + fit->size()) {
+            if (++fit == sf->content->end(cc_->alloc_))
+                break;
+            l = StringPiece(fit->data() - 1, 0);
         }
-        if (limiter_.exit_early())
-            break;
+        l = find_line(*fit, StringPiece(l.data() + l.size() + 1, 0));
+        m->context_after.push_back(l);
+    }
 
-        ++it;
-        ++lno;
+    if (!transform_ || transform_(m)) {
+        if (st->results)
+            st->results->push_back(m);
+        else
+            queue_.push(m);
+        limiter_.record_match(&st->matches);
     }
 }
 
 code_searcher::search_thread::search_thread(code_searcher *cs)
-    : cs_(cs) {
+    : cs_(cs), nodes_(FLAGS_numa ? numa_nodes() : 1) {
     if (FLAGS_search) {
         for (int i = 0; i < FLAGS_threads; ++i) {
-            threads_.emplace_back(search_one, this);
+            threads_.emplace_back(search_one, this, i % nodes_);
         }
         threads_.emplace_back(search_file_one, this);
     }
@@ -1120,50 +1830,145 @@ void code_searcher::search_thread::match(const query &q,
         cs_->alloc_->drop_caches();
     }
 
+    PROBE(query__start, q.trace_id.c_str(), q.line_pat->pattern().c_str());
     timer analyze_time(false);
     intrusive_ptr<IndexKey> index_key;
     {
         run_timer run(analyze_time);
+        query_trace::span span(q.trace, "indexRE");
         index_key = indexRE(*q.line_pat);
     }
+    if (index_key) {
+        stats->index_selectivity = index_key->selectivity();
+        stats->index_depth = index_key->depth();
+        stats->index_nodes = index_key->nodes();
+    }
     debug(kDebugProfile, "analyze time: %d.%06ds",
           int(analyze_time.elapsed().tv_sec),
           int(analyze_time.elapsed().tv_usec));
 
+    size_t nchunks = cs_->ready_chunks();
+    if (nchunks < cs_->total_chunks())
+        stats->partial = true;
+
     searcher search(cs_, q, index_key, func);
     filename_searcher file_search(cs_, q, index_key);
-    job j;
+    job j(nchunks, nodes_);
     j.trace_id = current_trace_id();
     j.search = &search;
     j.file_search = &file_search;
     j.pending = 0;
+    j.prefetch = NULL;
+
+    /*
+     * A query whose index key promises only a handful of candidates
+     * costs less to run here than to hand to the search threads.
+     * Search chunks on this thread until the candidates it turns up
+     * say otherwise, then give whatever is left to the workers.
+     */
+    bool run_inline = !q.filename_only && FLAGS_inline_search &&
+        FLAGS_index && index_key && !index_key->empty() &&
+        index_key->selectivity() <= FLAGS_inline_max_selectivity;
+    vector<chunk*> chunks(cs_->alloc_->begin(), cs_->alloc_->begin() + nchunks);
+    if (FLAGS_order_chunks && !q.filename_only) {
+        query_trace::span span(q.trace, "order_chunks");
+        search.order_chunks(&chunks);
+    }
+    if (FLAGS_residency_order && !q.filename_only)
+        order_by_residency(&chunks, stats);
+    auto next = chunks.begin();
+    vector<match_result*> inline_results;
+    if (run_inline) {
+        search_inline.inc();
+        search.enter_thread(&inline_results);
+        while (next != chunks.end()) {
+            // A chunk without a suffix array is scanned whole, however
+            // selective the key; leave it to the search threads.
+            if (!(*next)->suffixes)
+                break;
+            search(*next++);
+            if (search.thread_candidates() > FLAGS_inline_max_candidates)
+                break;
+        }
+        search.exit_thread();
+        if (next != chunks.end()) {
+            search_inline_handoff.inc();
+            debug(kDebugProfile, "inline search: handing off after %d chunks",
+                  int(next - chunks.begin()));
+        }
+    }
 
     if (!q.filename_only) {
-        for (int i = 0; i < FLAGS_threads; ++i) {
-            ++j.pending;
-            queue_.push(&j);
+        /*
+         * A scan reads each chunk front to back, but chunks are mapped
+         * MADV_RANDOM, so a chunk that is not resident comes in one
+         * page fault at a time. Start reading the first few chunks now;
+         * each search thread starts on another as it takes a chunk, so
+         * reads stay in flight ahead of the threads. An indexed search
+         * reads a few hundred scattered pages of a chunk, so it only
+         * gets the suffix-array pages every binary search starts on.
+         */
+        int sa_levels = search.scans_chunks() ? 0 : FLAGS_prefetch_sa_levels;
+        if (FLAGS_prefetch_chunks > 0 && next != chunks.end() &&
+            (search.scans_chunks() || sa_levels > 0)) {
+            j.prefetch = &chunks;
+            j.prefetch_sa_levels = sa_levels;
+            size_t first = next - chunks.begin();
+            size_t end = std::min(chunks.size(), first + FLAGS_prefetch_chunks);
+            for (size_t i = first; i < end; i++)
+                cs_->alloc_->prefetch(chunks[i], sa_levels);
+            j.prefetch_next = end;
+        }
+        if (next != chunks.end()) {
+            j.queued = monotonic_ns();
+            for (int i = 0; i < FLAGS_threads; ++i) {
+                ++j.pending;
+                queue_.push(&j);
+            }
+        } else {
+            search.queue_.close();
         }
 
-        for (auto it = cs_->alloc_->begin(); it != cs_->alloc_->end(); it++) {
-            j.chunks.push(*it);
+        search_chunks_queued.inc(chunks.end() - next);
+        for (; next != chunks.end(); next++) {
+            j.chunks[(*next)->node % nodes_]->push(*next);
         }
-        j.chunks.close();
+        for (auto it = j.chunks.begin(); it != j.chunks.end(); ++it)
+            (*it)->close();
     }
 
-    file_queue_.push(&j);
+    vector<file_result*> inline_file_results;
+    if (run_inline) {
+        file_search(&inline_file_results);
+        file_search.queue_.close();
+    } else {
+        file_queue_.push(&j);
+    }
 
     if (!q.filename_only) {
+        // Mostly waiting on the search threads; the callbacks show
+        // inside it.
+        query_trace::span span(q.trace, "deliver_results");
+        for (auto it = inline_results.begin(); it != inline_results.end(); ++it) {
+            matches++;
+            query_trace::span result(q.trace, "result");
+            cb(*it);
+        }
         while (search.queue_.pop(&m)) {
             matches++;
+            query_trace::span result(q.trace, "result");
             cb(m);
-            delete m;
         }
+        span.set("matches", matches);
     }
 
+    for (auto it = inline_file_results.begin(); it != inline_file_results.end(); ++it) {
+        file_matches++;
+        fcb(*it);
+    }
     while (file_search.queue_.pop(&f)) {
         file_matches++;
         fcb(f);
-        delete f;
     }
 
     if (q.filename_only) {
@@ -1177,9 +1982,36 @@ void code_searcher::search_thread::match(const query &q,
 
     struct timeval t = analyze_time.elapsed();
     timeradd(&stats->analyze_time, &t, &stats->analyze_time);
+    PROBE(query__done, q.trace_id.c_str(), stats->matches, int(stats->why));
 }
 
 
+/*
+ * Move the chunks that are mostly in memory to the front, keeping the
+ * order within each group, so that a search with a deadline spends it
+ * on chunks it can search without faulting. With --prefetch_chunks,
+ * match() reads in the rest a few at a time as the threads near them.
+ */
+void code_searcher::search_thread::order_by_residency(vector<chunk*> *chunks,
+                                                      match_stats *stats) {
+    vector<chunk*> cold;
+    size_t nresident = 0;
+    for (auto it = chunks->begin(); it != chunks->end(); ++it) {
+        size_t total;
+        size_t resident = cs_->alloc_->resident_bytes(*it, &total);
+        stats->resident_bytes += resident;
+        stats->nonresident_bytes += total - resident;
+        if (resident * 4 >= total * 3) {
+            (*chunks)[nresident++] = *it;
+        } else {
+            cold.push_back(*it);
+        }
+    }
+    std::copy(cold.begin(), cold.end(), chunks->begin() + nresident);
+    debug(kDebugProfile, "residency: %d of %d chunks resident",
+          int(nresident), int(chunks->size()));
+}
+
 code_searcher::search_thread::~search_thread() {
     queue_.close();
     file_queue_.close();
@@ -1187,15 +2019,36 @@ code_searcher::search_thread::~search_thread() {
         it->join();
 }
 
-void code_searcher::search_thread::search_one(search_thread *me) {
+void code_searcher::search_thread::search_one(search_thread *me, int node) {
+    if (me->nodes_ > 1)
+        numa_pin_thread(node, NULL);
     job *j;
     while (me->queue_.pop(&j)) {
         scoped_trace_id trace(j->trace_id);
 
         chunk *c;
-        while (j->chunks.pop(&c)) {
-            (*j->search)(c);
+        bool entered = false;
+        // Drain our own node's chunks, then help with the others'.
+        for (int k = 0; k < me->nodes_; ++k) {
+            bounded_queue<chunk*> *chunks = j->chunks[(node + k) % me->nodes_].get();
+            while (chunks->pop(&c)) {
+                search_chunks_queued.dec();
+                if (!entered) {
+                    j->search->record_queue_wait(j->queued);
+                    j->search->enter_thread();
+                    entered = true;
+                }
+                if (j->prefetch) {
+                    size_t i = j->prefetch_next++;
+                    if (i < j->prefetch->size())
+                        me->cs_->alloc_->prefetch((*j->prefetch)[i],
+                                                  j->prefetch_sa_levels);
+                }
+                (*j->search)(c);
+            }
         }
+        if (entered)
+            j->search->exit_thread();
 
         if (--j->pending == 0)
             j->search->queue_.close();
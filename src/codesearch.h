@@ -8,14 +8,19 @@
 #ifndef CODESEARCH_H
 #define CODESEARCH_H
 
+#include <assert.h>
+#include <stdint.h>
+
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <map>
 #include <fstream>
 #include <atomic>
 #include <mutex>
 #include <thread>
 #include <functional>
+#include <memory>
 #include <boost/intrusive_ptr.hpp>
 
 #ifdef USE_DENSE_HASH_SET
@@ -28,9 +33,12 @@
 #include <locale>
 
 #include "src/lib/thread_queue.h"
+#include "src/lib/bounded_queue.h"
 
 class searcher;
 class filename_searcher;
+class page_profile;
+class query_trace;
 class chunk_allocator;
 class file_contents;
 struct match_result;
@@ -71,6 +79,67 @@ enum exit_reason {
     kExitNone = 0,
     kExitTimeout,
     kExitMatchLimit,
+    kExitWorkLimit,
+};
+
+/*
+ * What a search did, as opposed to how long it took. Each thread counts
+ * into its own copy, without atomics; the copies are added up when the
+ * thread is done with the search.
+ */
+struct work_counters {
+    // Chunks handed to the search, and those of them it passed over:
+    // no file in them could match, or the search was already over.
+    int64_t chunks_considered;
+    int64_t chunks_skipped;
+    // Chunks searched through their suffix array, and chunks scanned
+    // whole.
+    int64_t chunks_indexed;
+    int64_t chunks_scanned;
+    // Calls to the line regex.
+    int64_t re2_calls;
+    // Range tree nodes (or, without a tree, ranges) visited to find
+    // the files holding a matching line.
+    int64_t find_match_nodes;
+    // Files checked for a matching line, and those that had one.
+    int64_t files_tried;
+    int64_t files_accepted;
+    // File content pieces walked while checking them.
+    int64_t pieces_walked;
+    // Results dropped as duplicates of ones already returned.
+    int64_t results_deduped;
+    // Work of the kinds query::budget limits: bytes given to the line
+    // regex, suffix-array candidates, and files tried for a line.
+    int64_t scan_bytes;
+    int64_t candidates;
+    int64_t try_matches;
+
+    work_counters() { clear(); }
+
+    void clear() {
+        chunks_considered = chunks_skipped = 0;
+        chunks_indexed = chunks_scanned = 0;
+        re2_calls = find_match_nodes = 0;
+        files_tried = files_accepted = pieces_walked = 0;
+        results_deduped = 0;
+        scan_bytes = candidates = try_matches = 0;
+    }
+
+    void add(const work_counters &o) {
+        chunks_considered += o.chunks_considered;
+        chunks_skipped += o.chunks_skipped;
+        chunks_indexed += o.chunks_indexed;
+        chunks_scanned += o.chunks_scanned;
+        re2_calls += o.re2_calls;
+        find_match_nodes += o.find_match_nodes;
+        files_tried += o.files_tried;
+        files_accepted += o.files_accepted;
+        pieces_walked += o.pieces_walked;
+        results_deduped += o.results_deduped;
+        scan_bytes += o.scan_bytes;
+        candidates += o.candidates;
+        try_matches += o.try_matches;
+    }
 };
 
 
@@ -82,6 +151,21 @@ struct match_stats {
     timeval analyze_time;
     int matches;
     exit_reason why;
+    // Set if the index was still loading, so only part of it was
+    // searched.
+    bool partial;
+    // With --residency_order, an estimate of how much of the searched
+    // chunks was in memory when the search started.
+    int64_t resident_bytes;
+    int64_t nonresident_bytes;
+    work_counters work;
+    // Time the search threads spent waiting between the query queueing
+    // its chunks and each of them starting on one, summed over threads.
+    timeval queue_wait;
+    // The query's index key (selectivity 1 and depth 0 without one).
+    double index_selectivity;
+    int index_depth;
+    long index_nodes;
 
     match_stats() : re2_time((struct timeval){0}),
         git_time((struct timeval){0}),
@@ -89,7 +173,14 @@ struct match_stats {
         index_time((struct timeval){0}),
         analyze_time((struct timeval){0}),
         matches(0),
-        why(kExitNone) {}
+        why(kExitNone),
+        partial(false),
+        resident_bytes(0),
+        nonresident_bytes(0),
+        queue_wait((struct timeval){0}),
+        index_selectivity(1),
+        index_depth(0),
+        index_nodes(0) {}
 };
 
 struct chunk;
@@ -97,8 +188,12 @@ struct chunk_file;
 struct json_object;
 
 struct indexed_tree {
+    int id;
     string name;
+    // For a loaded index, NULL until code_searcher::trees() parses
+    // metadata_json, the metadata as it lies in the mapping.
     json_object *metadata;
+    StringPiece metadata_json;
     string version;
 };
 
@@ -109,18 +204,144 @@ struct indexed_file {
     int no;
 };
 
+struct file_header;
+
+/*
+ * The files of an index, by number. An index built in memory owns an
+ * indexed_file for each of its files. A loaded one makes each the first
+ * time it is asked for, from the file table and filename data in the
+ * mapping, so that loading an index does not cost a heap object and a
+ * path copy per file.
+ */
+class file_table {
+public:
+    class const_iterator {
+    public:
+        const_iterator(const file_table *table, size_t i) : table_(table), i_(i) {}
+        indexed_file *operator*() const { return (*table_)[i_]; }
+        const_iterator &operator++() { ++i_; return *this; }
+        const_iterator operator++(int) { return const_iterator(table_, i_++); }
+        ptrdiff_t operator-(const const_iterator &rhs) const { return i_ - rhs.i_; }
+        bool operator==(const const_iterator &rhs) const { return i_ == rhs.i_; }
+        bool operator!=(const const_iterator &rhs) const { return i_ != rhs.i_; }
+        bool operator<(const const_iterator &rhs) const { return i_ < rhs.i_; }
+    private:
+        const file_table *table_;
+        size_t i_;
+    };
+
+    file_table() : size_(0), headers_(0), mapped_(0) {}
+    ~file_table();
+
+    size_t size() const {
+        return size_;
+    }
+    indexed_file *operator[](size_t i) const {
+        if (!headers_)
+            return owned_[i];
+        indexed_file *file = mapped_[i].load(std::memory_order_acquire);
+        return file ? file : make(i);
+    }
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+    const_iterator end() const {
+        return const_iterator(this, size_);
+    }
+
+    void push_back(indexed_file *file) {
+        assert(!headers_);
+        owned_.push_back(file);
+        size_ = owned_.size();
+    }
+
+    // Serve files from a mapped index: `headers' is its file table,
+    // `base' the start of the mapping that their offsets are from.
+    void map(const file_header *headers, size_t n, const uint8_t *base,
+             const vector<indexed_tree*> *trees,
+             const uint32_t *filename_offsets, const unsigned char *filename_data);
+
+private:
+    // Defined with the index format, in dump_load.cc.
+    indexed_file *make(size_t i) const;
+
+    size_t size_;
+    vector<indexed_file*> owned_;
+
+    const file_header *headers_;
+    const uint8_t *base_;
+    const vector<indexed_tree*> *trees_;
+    const uint32_t *filename_offsets_;
+    const unsigned char *filename_data_;
+    // Made files by number; calloc()ed, so that pages no file on them
+    // has been asked for are never touched.
+    std::atomic<indexed_file*> *mapped_;
+};
+
 struct index_info {
     std::string name;
     vector<indexed_tree> trees;
 };
 
+const int kContextLines = 3;
+
+/*
+ * Up to kContextLines lines of context around a match, stored inline so
+ * that a match_result needs no allocations of its own.
+ */
+class context_lines {
+public:
+    typedef const StringPiece *const_iterator;
+
+    context_lines() : size_(0) {}
+
+    void clear() {
+        size_ = 0;
+    }
+
+    void push_back(const StringPiece &line) {
+        assert(size_ < kContextLines);
+        lines_[size_++] = line;
+    }
+
+    void push_front(const StringPiece &line) {
+        assert(size_ < kContextLines);
+        std::copy_backward(lines_, lines_ + size_, lines_ + size_ + 1);
+        lines_[0] = line;
+        ++size_;
+    }
+
+    int size() const {
+        return size_;
+    }
+
+    const StringPiece &operator[](int i) const {
+        return lines_[i];
+    }
+
+    const_iterator begin() const {
+        return lines_;
+    }
+
+    const_iterator end() const {
+        return lines_ + size_;
+    }
+
+private:
+    StringPiece lines_[kContextLines];
+    int size_;
+};
+
 struct match_result {
     indexed_file *file;
     int lno;
-    vector<StringPiece> context_before;
-    vector<StringPiece> context_after;
+    context_lines context_before;
+    context_lines context_after;
     StringPiece line;
     int matchleft, matchright;
+    // The number of further files that contain this same line, but
+    // were not reported because of query::max_files_per_line.
+    int more_files;
 };
 
 struct file_result {
@@ -134,6 +355,21 @@ struct file_result {
 struct query {
     std::string trace_id;
     int32_t max_matches;
+    // Report at most this many files for any single matching line (0
+    // for no limit). Deduplicated lines like license headers can occur
+    // in thousands of files; the rest are only counted.
+    int32_t max_files_per_line;
+
+    // Limits on the work a search may do before it stops with
+    // kExitWorkLimit (0 for no limit): bytes handed to the line regex,
+    // suffix-array candidates examined, and files checked for a
+    // matching line. Unlike the timeout, these truncate a search at
+    // the same point however busy the machine is.
+    struct {
+        int64_t scan_bytes;
+        int64_t candidates;
+        int64_t try_matches;
+    } budget;
 
     std::shared_ptr<RE2> line_pat;
     std::shared_ptr<RE2> file_pat;
@@ -146,6 +382,9 @@ struct query {
     } negate;
 
     bool filename_only;
+
+    // If set, the search records the spans of its work here.
+    query_trace *trace;
 };
 
 class code_searcher {
@@ -154,6 +393,46 @@ public:
     ~code_searcher();
     void dump_index(const string& path);
     void load_index(const string& path);
+    // Load only an index's metadata (trees, files and the filename
+    // index), leaving its chunks to load_chunks(). The searcher may be
+    // queried in between; searches see the chunks loaded so far.
+    void begin_load_index(const string& path);
+    // Like the above, but if `path' cannot be read or is not an index
+    // this build can load, leave the searcher as it was, set *error and
+    // return false, instead of exiting.
+    bool begin_load_index(const string& path, string *error);
+    // Make the chunks of an index opened by begin_load_index()
+    // searchable, in order, stopping once `limit' of them are. With
+    // `populate', read each chunk's pages in before publishing it.
+    void load_chunks(bool populate, size_t limit = SIZE_MAX);
+
+    // The number of chunks searches look at, and the number the index
+    // has in all. They differ only while load_chunks() is running.
+    size_t ready_chunks() const {
+        return ready_chunks_.load(std::memory_order_acquire);
+    }
+    size_t total_chunks() const {
+        return total_chunks_;
+    }
+
+    // mlock() the parts of the index every search reads; see
+    // chunk_allocator::lock_pages(). Returns the number of bytes locked.
+    size_t lock_index(int sa_levels);
+
+    // Count the index pages that searches touch from now on, and write
+    // the counts to `path' every `interval' seconds and when the
+    // searcher is destroyed; see page_profile. The index must be fully
+    // loaded.
+    void enable_page_profile(const string& path, int interval);
+
+    // Whether the index has been warmed up. Nothing here depends on it;
+    // it tells servers whether to report themselves ready.
+    bool warm() const {
+        return warm_.load();
+    }
+    void set_warm(bool warm) {
+        warm_.store(warm);
+    }
 
     const indexed_tree *open_tree(const string &name, json_object *meta, const string& version);
     void index_file(const indexed_tree *tree,
@@ -172,10 +451,10 @@ public:
         name_ = name;
     }
 
-    vector<indexed_file*>::const_iterator begin_files() {
+    file_table::const_iterator begin_files() {
         return files_.begin();
     }
-    vector<indexed_file*>::const_iterator end_files() {
+    file_table::const_iterator end_files() {
         return files_.end();
     }
 
@@ -210,19 +489,39 @@ public:
                    match_stats *stats);
     protected:
         struct job {
+            // Each of `chunks' must hold every chunk without blocking,
+            // since match() queues them all before it drains any results.
+            job(size_t nchunks, int nodes) {
+                for (int i = 0; i < nodes; ++i)
+                    chunks.emplace_back(new bounded_queue<chunk*>(nchunks));
+            }
+
             std::string trace_id;
+            // When match() queued the job, from monotonic_ns().
+            int64_t queued;
             atomic_int pending;
             searcher *search;
             filename_searcher *file_search;
-            thread_queue<chunk*> chunks;
+            // The chunks to search, queued by home NUMA node.
+            vector<std::unique_ptr<bounded_queue<chunk*>>> chunks;
+            // With --prefetch_chunks, every chunk in search order, and
+            // the next of them to start reading; and what to read of
+            // each, as chunk_allocator::prefetch() takes it.
+            const vector<chunk*> *prefetch;
+            std::atomic<size_t> prefetch_next;
+            int prefetch_sa_levels;
         };
 
         const code_searcher *cs_;
+        // NUMA nodes that have their own search threads (1 without --numa).
+        int nodes_;
         vector<std::thread> threads_;
         thread_queue<job*> queue_;
         thread_queue<job*> file_queue_;
 
-        static void search_one(search_thread *);
+        void order_by_residency(vector<chunk*> *chunks, match_stats *stats);
+
+        static void search_one(search_thread *, int node);
         static void search_file_one(search_thread *);
     private:
         search_thread(const search_thread&);
@@ -247,16 +546,31 @@ protected:
     // Timestamp representing the end of index construction.
     int64_t index_timestamp_;
 
+    // The first ready_chunks_ of alloc_'s chunks are searchable.
+    std::atomic<size_t> ready_chunks_;
+    size_t total_chunks_;
+
+    std::atomic_bool warm_;
+    std::atomic<page_profile*> page_profile_;
+
     // Structures for fast filename search; somewhat similar to a single chunk.
-    // Built from files_ at finalization, not serialized or anything like that.
-    unsigned char *filename_data_;
+    // Built from files_ at finalization, and used directly from the mmap of
+    // a loaded index.
+    const unsigned char *filename_data_;
     int filename_data_size_;
-    uint32_t *filename_suffixes_;
-    // pairs (i, file), where file->path starts at filename_data_[i]
-    vector<pair<int, indexed_file*>> filename_positions_;
+    const uint32_t *filename_suffixes_;
+    // files_[i]->path starts at filename_data_[filename_offsets_[i]]; there
+    // is one extra entry, for the end of the data.
+    const uint32_t *filename_offsets_;
+    // Backing storage for the above when built in memory.
+    vector<unsigned char> filename_data_buf_;
+    vector<uint32_t> filename_suffixes_buf_;
+    vector<uint32_t> filename_offsets_buf_;
 
     vector<indexed_tree*> trees_;
-    vector<indexed_file*> files_;
+    // Guards the parsing of a loaded tree's metadata in trees().
+    mutable std::mutex tree_metadata_mtx_;
+    file_table files_;
 
 private:
     void index_filenames();
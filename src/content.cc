@@ -22,9 +22,10 @@ void file_contents_builder::extend(chunk *c, const StringPiece &piece) {
 
 file_contents *file_contents_builder::build(chunk_allocator *alloc) {
     size_t len = sizeof(uint32_t) * (1 + 3*pieces_.size());
-    file_contents *out = new(alloc->alloc_content_data(len)) file_contents(pieces_.size());
-    if (out == 0)
+    uint8_t *buf = alloc->alloc_content_data(len);
+    if (buf == 0)
         return 0;
+    file_contents *out = new(buf) file_contents(pieces_.size());
     for (int i = 0; i < pieces_.size(); i++) {
         const unsigned char *p = reinterpret_cast<const unsigned char*>
             (pieces_[i].data());
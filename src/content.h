@@ -82,6 +82,11 @@ public:
         return iterator(alloc, pieces_ + npieces_);
     }
 
+    iterator at(chunk_allocator *alloc, size_t i) {
+        assert(i < npieces_);
+        return iterator(alloc, pieces_ + i);
+    }
+
     piece *begin() {
         return pieces_;
     }
@@ -109,6 +114,9 @@ class file_contents_builder {
 public:
     void extend(chunk *chunk, const StringPiece &piece);
     file_contents *build(chunk_allocator *alloc);
+    size_t size() const {
+        return pieces_.size();
+    }
 protected:
     vector <StringPiece> pieces_;
 };
@@ -5,22 +5,45 @@
  * This program is free software. You may use, redistribute, and/or
  * modify it under the terms listed in the COPYING file.
  ********************************************************************/
+#include "src/lib/debug.h"
+#include "src/lib/numa.h"
+#include "src/lib/probes.h"
+#include "src/lib/timer.h"
+
 #include "src/codesearch.h"
 #include "src/chunk.h"
 #include "src/chunk_allocator.h"
 #include "src/content.h"
 #include "src/dump_load.h"
 
+#include <atomic>
 #include <map>
 #include <string>
 #include <memory>
 
+#include <string.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <json-c/json.h>
+#include <gflags/gflags.h>
+
+DECLARE_bool(numa);
+DEFINE_string(scan_only_trees, "", "When dumping an index, store the chunks whose trees all match this regex without a suffix array, to be scanned by searches.");
+
+static bool validate_scan_only_trees(const char* flagname, const string& value) {
+    if (value.empty())
+        return true;
+    RE2 re(value, RE2::Quiet);
+    if (!re.ok())
+        fprintf(stderr, "--%s: %s\n", flagname, re.error().c_str());
+    return re.ok();
+}
+
+static const bool dummy_scan_only = gflags::RegisterFlagValidator(&FLAGS_scan_only_trees,
+                                                                  validate_scan_only_trees);
 
 class codesearch_index {
 public:
@@ -49,11 +72,14 @@ public:
 protected:
     void dump_chunk_data();
     void dump_metadata();
-    void dump_file(map<const indexed_tree*, int>& ids, indexed_file *sf);
-    void dump_chunk_file(chunk_file *cf);
-    void dump_chunk_files(chunk *, chunk_header *);
+    void dump_files();
+    void dump_filenames();
+    void dump_chunk_ranges(chunk *, chunk_header *);
+    void dump_chunk_postings(chunk *, chunk_header *);
+    void dump_chunk_lines(chunk *, chunk_header *);
     void dump_chunk_data(chunk *);
     void dump_content_data();
+    bool is_scan_only(const chunk *);
 
     void alignp(uint32_t align) {
         streampos pos = stream_.tellp();
@@ -69,6 +95,11 @@ protected:
         dump(&i);
     }
 
+    template<class T>
+    void dump_array(const T *t, size_t n) {
+        stream_.write(reinterpret_cast<const char*>(t), sizeof(T) * n);
+    }
+
     void dump_string(const string &str) {
         dump_int32(str.size());
         stream_.write(str.c_str(), str.size());
@@ -84,6 +115,7 @@ protected:
     index_header hdr_;
     vector<chunk_header> chunks_;
     vector<content_chunk_header> content_;
+    std::unique_ptr<RE2> scan_only_trees_;
 
     friend class dump_allocator;
 };
@@ -167,26 +199,40 @@ protected:
 
 class load_allocator : public chunk_allocator {
 public:
-    load_allocator(code_searcher *cs, const string& path);
+    load_allocator() : fd_(-1), map_(MAP_FAILED), huge_(use_huge_pages()) {}
 
     ~load_allocator() {
-        close(fd_);
-        munmap(map_, map_size_);
+        if (map_ != MAP_FAILED)
+            munmap(map_, map_size_);
+        if (fd_ != -1)
+            close(fd_);
     }
 
+    // Map the index at `path' and check that it is one this build can
+    // load; if not, set *error and return false.
+    bool open(code_searcher *cs, const string& path, string *error);
+
     virtual chunk *alloc_chunk();
     virtual buffer alloc_content_chunk() {
         assert(0);
     }
 
     virtual void free_chunk(chunk *chunk) {
+        if (huge_) {
+            free_huge(chunk->data, chunk_size_);
+            free_huge(chunk->suffixes, chunk_size_ * sizeof(uint32_t));
+        }
         delete chunk;
     }
 
     virtual void drop_caches() {
+        // Dropping the pages of an anonymous copy would zero it.
+        if (huge_)
+            return;
         for (auto it = begin(); it != end(); ++it) {
             madvise((*it)->data, (*it)->size, MADV_DONTNEED);
-            madvise((*it)->suffixes, (*it)->size * sizeof(*(*it)->suffixes), MADV_DONTNEED);
+            if ((*it)->suffixes)
+                madvise((*it)->suffixes, (*it)->size * sizeof(*(*it)->suffixes), MADV_DONTNEED);
         }
 #ifdef POSIX_FADV_DONTNEED
         posix_fadvise(fd_, hdr_->chunks_off,
@@ -195,7 +241,14 @@ public:
 #endif
     }
 
+    virtual size_t lock_pages(int sa_levels);
+
+    virtual void prefetch(const chunk *chunk, int sa_levels);
+
+    virtual size_t resident_bytes(const chunk *chunk, size_t *total);
+
     void load(code_searcher *cs);
+    void load_chunks(code_searcher *cs, bool populate, size_t limit);
 protected:
     template <class T>
     T *consume() {
@@ -214,8 +267,9 @@ protected:
         p_ = static_cast<uint8_t*>(map_) + off;
     }
 
-    indexed_file *load_file(code_searcher *cs);
+    void load_files(code_searcher *cs);
     void load_chunk(code_searcher *);
+    void populate(chunk *);
 
     uint32_t load_int32() {
         return *(consume<uint32_t>());
@@ -231,8 +285,19 @@ protected:
     int fd_;
     void *map_;
     size_t map_size_;
+    // Whether chunks are copied out of the mapping into huge pages.
+    bool huge_;
     uint8_t *p_;
 
+    // The last residency estimate of each chunk, by id, and when it was
+    // taken, so that a stream of searches does not sample every chunk
+    // with mincore() each time.
+    struct residency_sample {
+        std::atomic<int64_t> taken;
+        std::atomic<size_t> resident;
+    };
+    std::unique_ptr<residency_sample[]> residency_;
+
     index_header *hdr_;
     chunk_header *chunks_hdr_;
     chunk_header *next_chunk_;
@@ -242,29 +307,91 @@ chunk_allocator *make_dump_allocator(code_searcher *search, const string& path)
     return new dump_allocator(search, path.c_str());
 }
 
-void codesearch_index::dump_file(map<const indexed_tree*, int>& ids, indexed_file *sf) {
-    dump_int32(ids[sf->tree]);
-    dump_string(sf->path);
-}
+void codesearch_index::dump_files() {
+    // Content chunks by address, to find each file's contents on disk.
+    map<const uint8_t*, int> content_ids;
+    for (auto it = cs_->alloc_->begin_content();
+         it != cs_->alloc_->end_content(); ++it)
+        content_ids[it->data] = it - cs_->alloc_->begin_content();
 
-void codesearch_index::dump_chunk_file(chunk_file *cf) {
-    dump_int32(cf->files.size());
-    for (list<indexed_file*>::iterator it = cf->files.begin();
-         it != cf->files.end(); ++it)
-        dump_int32((*it)->no);
+    hdr_.files_off = stream_.tellp();
+    for (auto it = cs_->files_.begin(); it != cs_->files_.end(); ++it) {
+        const uint8_t *p = reinterpret_cast<const uint8_t*>((*it)->content);
+        auto cit = content_ids.upper_bound(p);
+        assert(cit != content_ids.begin());
+        --cit;
+        file_header fhdr = {
+            uint32_t((*it)->tree->id),
+            content_[cit->second].file_off + (p - cit->first)
+        };
+        dump(&fhdr);
+    }
+}
 
-    dump_int32(cf->left);
-    dump_int32(cf->right);
+void codesearch_index::dump_filenames() {
+    alignp(sizeof(uint64_t));
+    hdr_.filenames_off = stream_.tellp();
+    hdr_.filename_data_size = cs_->filename_data_size_;
+    dump_array(cs_->filename_offsets_, cs_->files_.size() + 1);
+    dump_array(cs_->filename_suffixes_, cs_->filename_data_size_);
+    dump_array(cs_->filename_data_, cs_->filename_data_size_);
 }
 
-void codesearch_index::dump_chunk_files(chunk *chunk, chunk_header *hdr) {
-    hdr->files_off = stream_.tellp();
-    hdr->nfiles = chunk->files.size();
+void codesearch_index::dump_chunk_ranges(chunk *chunk, chunk_header *hdr) {
+    alignp(sizeof(uint64_t));
+    hdr->ranges_off = stream_.tellp();
     hdr->size = chunk->size;
+    hdr->nranges = chunk->nranges;
+    hdr->nrange_files = chunk->nranges ?
+        chunk->ranges[chunk->nranges - 1].first +
+        chunk->ranges[chunk->nranges - 1].count : 0;
+    dump_array(chunk->ranges, chunk->nranges);
+    dump_array(chunk->range_limits, chunk->nranges);
+    dump_array(chunk->range_files, hdr->nrange_files);
+
+    alignp(sizeof(uint64_t));
+    hdr->tree_bits_off = stream_.tellp();
+    hdr->ntree_words = chunk->ntree_words;
+    dump_array(chunk->tree_bits, chunk->ntree_words);
+}
+
+void codesearch_index::dump_chunk_postings(chunk *chunk, chunk_header *hdr) {
+    line_postings *p = chunk->postings;
+    if (!p) {
+        hdr->postings_off = 0;
+        return;
+    }
+    alignp(sizeof(uint64_t));
+    hdr->postings_off = stream_.tellp();
+
+    uint64_t nlines = p->nlines_;
+    dump(&nlines);
+    stream_.write(reinterpret_cast<const char*>(p->post_off_),
+                  sizeof(uint64_t) * (nlines + 1));
+    stream_.write(reinterpret_cast<const char*>(p->line_off_),
+                  sizeof(uint32_t) * nlines);
+    stream_.write(reinterpret_cast<const char*>(p->data_),
+                  p->post_off_[nlines]);
+}
 
-    for (vector<chunk_file>::iterator it = chunk->files.begin();
-         it != chunk->files.end(); it ++)
-        dump_chunk_file(&(*it));
+void codesearch_index::dump_chunk_lines(chunk *chunk, chunk_header *hdr) {
+    line_directory *l = chunk->lines;
+    if (!l) {
+        hdr->lines_off = 0;
+        return;
+    }
+    alignp(sizeof(uint64_t));
+    hdr->lines_off = stream_.tellp();
+
+    uint64_t size = l->size_, nnewlines = l->nnewlines_;
+    dump(&size);
+    dump(&nnewlines);
+    stream_.write(reinterpret_cast<const char*>(l->words_),
+                  sizeof(uint64_t) * l->nwords_);
+    stream_.write(reinterpret_cast<const char*>(l->block_rank_),
+                  sizeof(uint32_t) * (l->nblocks_ + 1));
+    stream_.write(reinterpret_cast<const char*>(l->samples_),
+                  sizeof(uint32_t) * l->nsamples_);
 }
 
 void codesearch_index::dump_chunk_data(chunk *chunk) {
@@ -274,8 +401,13 @@ void codesearch_index::dump_chunk_data(chunk *chunk) {
     chunk_header chdr;
     chdr.data_off = off;
     chdr.size = chunk->size;
+    chdr.flags = is_scan_only(chunk) ? kChunkNoSuffixes : 0;
     chunks_.push_back(chdr);
 
+    if (chdr.flags & kChunkNoSuffixes) {
+        stream_.write(reinterpret_cast<char*>(chunk->data), chunk->size);
+        return;
+    }
     assert(ftruncate(fd_, off + 5 * hdr_.chunk_size) == 0);
     stream_.write(reinterpret_cast<char*>(chunk->data), hdr_.chunk_size);
     stream_.write(reinterpret_cast<char*>(chunk->suffixes),
@@ -283,6 +415,32 @@ void codesearch_index::dump_chunk_data(chunk *chunk) {
     stream_.seekp(off + 5 * hdr_.chunk_size);
 }
 
+/*
+ * A chunk is dumped without a suffix array if it has none to begin
+ * with, or if every tree with files in it matches --scan_only_trees.
+ * Such chunks take a fifth of the space, and queries scan them instead
+ * of using the index, so they suit trees that are rarely searched.
+ */
+bool codesearch_index::is_scan_only(const chunk *chunk) {
+    if (!chunk->suffixes)
+        return true;
+    if (FLAGS_scan_only_trees.empty() || chunk->ntree_words == 0)
+        return false;
+    if (!scan_only_trees_) {
+        scan_only_trees_.reset(new RE2(FLAGS_scan_only_trees));
+        if (!scan_only_trees_->ok())
+            die("--scan_only_trees: %s", scan_only_trees_->error().c_str());
+    }
+    for (uint32_t w = 0; w < chunk->ntree_words; w++) {
+        for (uint64_t bits = chunk->tree_bits[w]; bits; bits &= bits - 1) {
+            const string &name = cs_->trees_[w * 64 + __builtin_ctzll(bits)]->name;
+            if (!RE2::FullMatch(name, *scan_only_trees_))
+                return false;
+        }
+    }
+    return true;
+}
+
 void codesearch_index::dump_metadata() {
     hdr_.ntrees   = cs_->trees_.size();
     hdr_.nfiles   = cs_->files_.size();
@@ -292,29 +450,28 @@ void codesearch_index::dump_metadata() {
     hdr_.name_off = stream_.tellp();
     dump_string(cs_->name());
 
-    map<const indexed_tree*, int> tree_ids;
-
     hdr_.refs_off = stream_.tellp();
     for (auto it = cs_->trees_.begin();
          it != cs_->trees_.end(); ++it) {
         dump_string((*it)->name);
         dump_string((*it)->version);
+        // A loaded tree's metadata is written back as it was read,
+        // without parsing it.
         if ((*it)->metadata)
             dump_string(json_object_to_json_string((*it)->metadata));
         else
-            dump_string("");
-        tree_ids[*it] = it - cs_->trees_.begin();
+            dump_string((*it)->metadata_json.as_string());
     }
-    hdr_.files_off = stream_.tellp();
-    for (vector<indexed_file*>::iterator it = cs_->files_.begin();
-         it != cs_->files_.end(); ++it)
-        dump_file(tree_ids, *it);
+    dump_files();
+    dump_filenames();
 
     auto hdr = chunks_.begin();
     for (auto it = cs_->alloc_->begin();
          it != cs_->alloc_->end(); ++it, ++hdr) {
         assert(hdr != chunks_.end());
-        dump_chunk_files(*it, &(*hdr));
+        dump_chunk_ranges(*it, &(*hdr));
+        dump_chunk_postings(*it, &(*hdr));
+        dump_chunk_lines(*it, &(*hdr));
     }
 
     hdr_.chunks_off = stream_.tellp();
@@ -360,42 +517,124 @@ void codesearch_index::dump() {
     dump(&hdr_);
 }
 
-load_allocator::load_allocator(code_searcher *cs, const string& path) {
-    fd_ = open(path.c_str(), O_RDONLY);
+bool load_allocator::open(code_searcher *cs, const string& path, string *error) {
+    fd_ = ::open(path.c_str(), O_RDONLY);
     if (fd_ == -1) {
-        string message = "Cannot open " + path;
-        perror(message.c_str());
-        exit(1);
+        *error = "Cannot open " + path + ": " + strerror(errno);
+        return false;
     }
     struct stat st;
-    assert(fstat(fd_, &st) == 0);
+    if (fstat(fd_, &st) != 0) {
+        *error = "Cannot stat " + path + ": " + strerror(errno);
+        return false;
+    }
     map_size_ = st.st_size;
+    if (map_size_ < sizeof(index_header)) {
+        *error = path + " is too short to be an index";
+        return false;
+    }
     map_ = mmap(NULL, map_size_, PROT_READ, MAP_SHARED,
                 fd_, 0);
-    assert(map_ != MAP_FAILED);
+    if (map_ == MAP_FAILED) {
+        *error = "Cannot map " + path + ": " + strerror(errno);
+        return false;
+    }
     p_ = static_cast<unsigned char*>(map_);
 
     hdr_ = consume<index_header>();
+    if (hdr_->magic != kIndexMagic) {
+        *error = path + " is not an index";
+        return false;
+    }
+    if (hdr_->version != kIndexVersion) {
+        *error = strprintf("%s is an index of version %u; this build reads version %u",
+                           path.c_str(), hdr_->version, kIndexVersion);
+        return false;
+    }
+    // The header's offsets are only filled in once the sections are
+    // written, so an index cut short while being dumped has none.
+    if (!hdr_->chunks_off || hdr_->chunks_off >= map_size_ ||
+        hdr_->name_off >= map_size_) {
+        *error = path + " is incomplete";
+        return false;
+    }
     set_chunk_size(hdr_->chunk_size);
     chunks_hdr_ = next_chunk_ = ptr<chunk_header>(hdr_->chunks_off);
 
     p_ = ptr<unsigned char>(hdr_->name_off);
     cs->set_name(load_string());
+    return true;
 }
 
 
 chunk *load_allocator::alloc_chunk() {
     unsigned char *data = ptr<unsigned char>(next_chunk_->data_off);
     uint32_t *indexes = reinterpret_cast<uint32_t*>(data + chunk_size_);
+    if (next_chunk_->flags & kChunkNoSuffixes)
+        indexes = NULL;
+    if (!huge_)
+        return new chunk(data, indexes);
+
+    // Searches read the copy; the mapping's pages can be dropped. The
+    // copies are a full chunk_size_ like any other chunk's buffers, but
+    // only `size' bytes of them are ever touched.
+    size_t size = next_chunk_->size;
+    unsigned char *data_copy = static_cast<unsigned char*>(alloc_huge(chunk_size_));
+    uint32_t *indexes_copy = indexes ?
+        static_cast<uint32_t*>(alloc_huge(chunk_size_ * sizeof(uint32_t))) : NULL;
+    if (!data_copy || (indexes && !indexes_copy))
+        die("Unable to allocate huge pages for a chunk");
+    memcpy(data_copy, data, size);
+    madvise(data, size, MADV_DONTNEED);
+    if (indexes) {
+        memcpy(indexes_copy, indexes, size * sizeof(uint32_t));
+        madvise(indexes, size * sizeof(uint32_t), MADV_DONTNEED);
+    }
+    return new chunk(data_copy, indexes_copy);
+}
 
-    return new chunk(data, indexes);
+void load_allocator::load_files(code_searcher *cs) {
+    cs->filename_data_size_ = hdr_->filename_data_size;
+    cs->filename_offsets_ = ptr<uint32_t>(hdr_->filenames_off);
+    cs->filename_suffixes_ = cs->filename_offsets_ + hdr_->nfiles + 1;
+    cs->filename_data_ = reinterpret_cast<const unsigned char*>
+        (cs->filename_suffixes_ + hdr_->filename_data_size);
+
+    cs->files_.map(ptr<file_header>(hdr_->files_off), hdr_->nfiles,
+                   static_cast<const uint8_t*>(map_), &cs->trees_,
+                   cs->filename_offsets_, cs->filename_data_);
+}
+
+void file_table::map(const file_header *headers, size_t n, const uint8_t *base,
+                     const vector<indexed_tree*> *trees,
+                     const uint32_t *filename_offsets,
+                     const unsigned char *filename_data) {
+    assert(!size_);
+    headers_ = headers;
+    base_ = base;
+    trees_ = trees;
+    filename_offsets_ = filename_offsets;
+    filename_data_ = filename_data;
+    mapped_ = static_cast<std::atomic<indexed_file*>*>(calloc(n ? n : 1, sizeof(*mapped_)));
+    size_ = n;
 }
 
-indexed_file *load_allocator::load_file(code_searcher *cs) {
+indexed_file *file_table::make(size_t i) const {
+    const file_header *fhdr = headers_ + i;
+    const uint32_t *off = filename_offsets_ + i;
     indexed_file *sf = new indexed_file;
-    sf->tree = cs->trees_[load_int32()];
-    sf->path = load_string();
-    sf->no = cs->files_.size();
+    sf->tree = (*trees_)[fhdr->tree];
+    sf->path.assign(reinterpret_cast<const char*>(filename_data_ + off[0]),
+                    off[1] - off[0] - 1);
+    sf->content = reinterpret_cast<file_contents*>
+        (const_cast<uint8_t*>(base_ + fhdr->content_off));
+    sf->no = i;
+    // Two threads may make the same file at once; keep the first.
+    indexed_file *expected = NULL;
+    if (!mapped_[i].compare_exchange_strong(expected, sf, std::memory_order_acq_rel)) {
+        delete sf;
+        return expected;
+    }
     return sf;
 }
 
@@ -406,19 +645,18 @@ void load_allocator::load_chunk(code_searcher *cs) {
     assert(next_chunk_->size <= hdr_->chunk_size);
     chunk->size = next_chunk_->size;
 
-    p_ = ptr<unsigned char>(next_chunk_->files_off);
-
-    for (int i = 0; i < next_chunk_->nfiles; i++) {
-        chunk->files.push_back(chunk_file());
-        chunk_file &cf = chunk->files.back();
-        uint32_t nfiles = load_int32();
-        for (int j = 0; j < nfiles; j++)
-            cf.files.push_back(cs->files_[load_int32()]);
-        cf.left  = load_int32();
-        cf.right = load_int32();
-    }
-    chunk->build_tree_names();
-    chunk->build_tree();
+    chunk->nranges = next_chunk_->nranges;
+    chunk->ranges = ptr<chunk_range>(next_chunk_->ranges_off);
+    chunk->range_limits = reinterpret_cast<const uint32_t*>
+        (chunk->ranges + chunk->nranges);
+    chunk->range_files = chunk->range_limits + chunk->nranges;
+    chunk->ntree_words = next_chunk_->ntree_words;
+    chunk->tree_bits = ptr<uint64_t>(next_chunk_->tree_bits_off);
+
+    if (next_chunk_->postings_off)
+        chunk->postings = new line_postings(ptr<uint8_t>(next_chunk_->postings_off));
+    if (next_chunk_->lines_off)
+        chunk->lines = new line_directory(ptr<uint8_t>(next_chunk_->lines_off));
     ++next_chunk_;
 }
 
@@ -437,52 +675,213 @@ void load_allocator::load(code_searcher *cs) {
         indexed_tree *tree = new indexed_tree;
         tree->name = load_string();
         tree->version = load_string();
-        string metadata = load_string();
-        if (metadata.size() == 0) {
-            tree->metadata = NULL;
-        } else {
-            json_object *js = json_tokener_parse(metadata.c_str());
-            assert(!is_error(js));
-            tree->metadata = js;
-        }
+        // Parsed only if code_searcher::trees() is asked for it.
+        uint32_t len = load_int32();
+        tree->metadata = NULL;
+        tree->metadata_json = StringPiece(reinterpret_cast<const char*>(p_), len);
+        p_ += len;
+        tree->id = cs->trees_.size();
 
         cs->trees_.push_back(tree);
     }
 
-    p_ = ptr<uint8_t>(hdr_->files_off);
-    for (int i = 0; i < hdr_->nfiles; i++) {
-        cs->files_.push_back(load_file(cs));
+    load_files(cs);
+
+    content_chunk_header *chdr = ptr<content_chunk_header>(hdr_->content_off);
+    for (int i = 0; i < hdr_->ncontent; i++, chdr++) {
+        buffer b = {
+            ptr<uint8_t>(chdr->file_off),
+            ptr<uint8_t>(chdr->file_off) + chdr->size
+        };
+        content_chunks_.push_back(b);
     }
 
+    struct stat st;
+    assert(fstat(fd_, &st) == 0);
+    cs->index_timestamp_ = st.st_mtime;
+
+    /*
+     * Every chunk object exists, pointing into the mapped index, before
+     * anything is searched: a file's pieces may lie in any chunk, so
+     * walking the pieces of a match in a ready chunk can take us into
+     * chunks that load_chunks() has not reached yet. Only which chunks
+     * get searched waits for load_chunks(). (With --huge_pages, this is
+     * where the chunks are copied, so there is little left to defer.)
+     */
     assert(!current_);
-    for (int i = 0; i < hdr_->nchunks; i++) {
+    for (int i = 0; i < hdr_->nchunks; i++)
         load_chunk(cs);
+    cs->total_chunks_ = hdr_->nchunks;
+    residency_.reset(new residency_sample[hdr_->nchunks]());
+    cs->finalized_ = true;
+    PROBE(load__metadata__done, hdr_->nfiles, hdr_->nchunks);
+}
+
+void load_allocator::populate(chunk *chunk) {
+    size_t lens[] = {
+        size_t(chunk->size), chunk->suffixes ? chunk->size * sizeof(*chunk->suffixes) : 0
+    };
+    const uint8_t *bases[] = {
+        chunk->data, reinterpret_cast<const uint8_t*>(chunk->suffixes)
+    };
+    for (int i = 0; i < 2; i++) {
+        madvise(const_cast<uint8_t*>(bases[i]), lens[i], MADV_WILLNEED);
+        volatile uint8_t sink = 0;
+        for (size_t off = 0; off < lens[i]; off += kPageSize)
+            sink += bases[i][off];
     }
+}
 
-    content_chunk_header *chdr = ptr<content_chunk_header>(hdr_->content_off);
-    auto it = cs->files_.begin();
-    for (int i = 0; i < hdr_->ncontent; i++) {
-        buffer b;
-        p_ = ptr<uint8_t>(chdr->file_off);
-        b.data = p_;
-        while (p_ < ptr<uint8_t>(chdr->file_off + chdr->size)) {
-            (*it)->content = new(p_) file_contents;
-            p_ = reinterpret_cast<uint8_t*>((*it)->content->end());
-            ++it;
+namespace {
+    const int kResidencySamples = 16;
+    // How long a chunk's residency estimate is reused for.
+    const int64_t kResidencyMaxAgeNs = 1000000000;
+
+    // Estimate the resident bytes of [p, p + len) from the residency
+    // of kResidencySamples evenly spaced pages.
+    size_t sample_resident(const void *p, size_t len) {
+        if (len == 0)
+            return 0;
+        uintptr_t base = uintptr_t(p) & ~uintptr_t(kPageSize - 1);
+        size_t npages = (uintptr_t(p) + len - base + kPageSize - 1) / kPageSize;
+        int samples = std::min<size_t>(npages, kResidencySamples);
+        int resident = 0;
+        for (int i = 0; i < samples; i++) {
+            unsigned char vec;
+            uintptr_t page = base + (npages * i / samples) * kPageSize;
+            if (mincore(reinterpret_cast<void*>(page), kPageSize, &vec) == 0 && (vec & 1))
+                ++resident;
         }
-        b.end = p_;
-        content_chunks_.push_back(b);
-        ++chdr;
+        return len * resident / samples;
     }
-    assert(it == cs->files_.end());
 
-    struct stat st;
-    assert(fstat(fd_, &st) == 0);
-    cs->index_timestamp_ = st.st_mtime;
+    bool lock_range(const void *p, size_t len, size_t *locked) {
+        if (len == 0)
+            return true;
+        uintptr_t start = uintptr_t(p) & ~uintptr_t(kPageSize - 1);
+        uintptr_t end = (uintptr_t(p) + len + kPageSize - 1) & ~uintptr_t(kPageSize - 1);
+        if (mlock(reinterpret_cast<void*>(start), end - start) != 0) {
+            perror("mlock");
+            return false;
+        }
+        *locked += end - start;
+        return true;
+    }
 
-    cs->index_filenames();
+    // The first `sa_levels' steps of every binary search over a chunk's
+    // suffix array probe the same evenly spaced entries. Calls f on
+    // each, in order, until it returns false.
+    template <class F>
+    bool each_sa_probe(const chunk *c, int sa_levels, F f) {
+        for (uint64_t k = 0; k < (uint64_t(1) << sa_levels); k++) {
+            uint64_t idx = (uint64_t(c->size) * k) >> sa_levels;
+            if (!f(c->suffixes + idx))
+                return false;
+        }
+        return true;
+    }
+};
 
-    cs->finalized_ = true;
+void load_allocator::prefetch(const chunk *chunk, int sa_levels) {
+    if (huge_)
+        return;
+    if (sa_levels == 0) {
+        madvise(chunk->data, chunk->size, MADV_WILLNEED);
+        return;
+    }
+    if (chunk->size == 0 || !chunk->suffixes)
+        return;
+    // Reading the whole suffix array would cost four times the chunk
+    // for a search that touches a few hundred of its pages; ask only
+    // for the ones every search starts on.
+    uintptr_t last = 0;
+    each_sa_probe(chunk, sa_levels, [&](const uint32_t *p) {
+        uintptr_t page = uintptr_t(p) & ~uintptr_t(kPageSize - 1);
+        if (page != last)
+            madvise(reinterpret_cast<void*>(page), kPageSize, MADV_WILLNEED);
+        last = page;
+        return true;
+    });
+}
+
+size_t load_allocator::resident_bytes(const chunk *chunk, size_t *total) {
+    if (huge_)
+        return chunk_allocator::resident_bytes(chunk, total);
+    size_t suffix_len = chunk->suffixes ? chunk->size * sizeof(uint32_t) : 0;
+    *total = chunk->size + suffix_len;
+    residency_sample &cached = residency_[chunk->id];
+    int64_t now = coarse_monotonic_ns();
+    int64_t taken = cached.taken.load(std::memory_order_relaxed);
+    if (taken && now - taken < kResidencyMaxAgeNs)
+        return cached.resident.load(std::memory_order_relaxed);
+    size_t resident = sample_resident(chunk->data, chunk->size) +
+        sample_resident(chunk->suffixes, suffix_len);
+    cached.resident.store(resident, std::memory_order_relaxed);
+    cached.taken.store(now, std::memory_order_relaxed);
+    return resident;
+}
+
+/*
+ * Locks the filename index and, for each chunk, its file ranges, tree
+ * bitmap, postings and line directory, plus a sample of suffix-array
+ * pages at the points a binary search visits first. Stops at the first
+ * failure, which is usually RLIMIT_MEMLOCK.
+ */
+size_t load_allocator::lock_pages(int sa_levels) {
+    size_t locked = 0;
+    size_t nfiles = hdr_->nfiles;
+    size_t filenames_len = sizeof(uint32_t) * (nfiles + 1) +
+        (sizeof(uint32_t) + 1) * size_t(hdr_->filename_data_size);
+    if (!lock_range(ptr<uint8_t>(hdr_->filenames_off), filenames_len, &locked))
+        return locked;
+
+    for (size_t i = 0; i < chunks_.size(); i++) {
+        chunk *c = chunks_[i];
+        const chunk_header *chdr = chunks_hdr_ + i;
+        size_t ranges_len = (sizeof(chunk_range) + sizeof(uint32_t)) * chdr->nranges +
+            sizeof(uint32_t) * chdr->nrange_files;
+        if (!lock_range(c->ranges, ranges_len, &locked) ||
+            !lock_range(c->tree_bits, sizeof(uint64_t) * c->ntree_words, &locked))
+            return locked;
+        if (c->postings &&
+            !lock_range(ptr<uint8_t>(chdr->postings_off), c->postings->mapped_size(), &locked))
+            return locked;
+        if (c->lines &&
+            !lock_range(ptr<uint8_t>(chdr->lines_off), c->lines->mapped_size(), &locked))
+            return locked;
+        if (c->size == 0 || !c->suffixes)
+            continue;
+        if (!each_sa_probe(c, sa_levels, [&](const uint32_t *p) {
+                    return lock_range(p, sizeof(uint32_t), &locked);
+                }))
+            return locked;
+    }
+    return locked;
+}
+
+/*
+ * The chunks themselves were all set up by load(); this only reads them
+ * in and publishes them to searches through ready_chunks_.
+ */
+void load_allocator::load_chunks(code_searcher *cs, bool populate, size_t limit) {
+    // With --numa, read each chunk in from a CPU on its home node, so
+    // that its page cache is allocated there.
+    bool place = populate && FLAGS_numa && numa_nodes() > 1;
+    bool pinned = false;
+    cpu_set_t saved;
+    size_t end = std::min(size_t(hdr_->nchunks), limit);
+    for (size_t i = cs->ready_chunks(); i < end; i++) {
+        chunk *c = at(i);
+        PROBE(load__chunk, i);
+        if (place && numa_pin_thread(c->node, pinned ? NULL : &saved))
+            pinned = true;
+        if (populate)
+            this->populate(c);
+        cs->ready_chunks_.store(i + 1, std::memory_order_release);
+    }
+    if (pinned)
+        sched_setaffinity(0, sizeof(saved), &saved);
+    PROBE(load__done, hdr_->nchunks);
 }
 
 void code_searcher::dump_index(const string &path) {
@@ -491,7 +890,32 @@ void code_searcher::dump_index(const string &path) {
 }
 
 void code_searcher::load_index(const string &path) {
-    load_allocator *alloc = new load_allocator(this, path);
+    begin_load_index(path);
+    load_chunks(false);
+}
+
+void code_searcher::begin_load_index(const string &path) {
+    string error;
+    if (!begin_load_index(path, &error))
+        die("%s", error.c_str());
+}
+
+bool code_searcher::begin_load_index(const string &path, string *error) {
+    PROBE(load__start, path.c_str());
+    load_allocator *alloc = new load_allocator;
+    if (!alloc->open(this, path, error)) {
+        delete alloc;
+        return false;
+    }
     set_alloc(alloc);
     alloc->load(this);
+    return true;
+}
+
+void code_searcher::load_chunks(bool populate, size_t limit) {
+    static_cast<load_allocator*>(alloc_)->load_chunks(this, populate, limit);
+}
+
+size_t code_searcher::lock_index(int sa_levels) {
+    return alloc_->lock_pages(sa_levels);
 }
@@ -11,7 +11,7 @@
 #include <stdint.h>
 
 const uint32_t kIndexMagic   = 0xc0d35eac;
-const uint32_t kIndexVersion = 13;
+const uint32_t kIndexVersion = 17;
 const uint32_t kPageSize     = (1 << 12);
 
 struct index_header {
@@ -32,13 +32,41 @@ struct index_header {
 
     uint32_t ncontent;
     uint64_t content_off;
+
+    // The filename index: uint32_t offsets[nfiles + 1], uint32_t
+    // suffixes[filename_data_size], then the NUL-terminated paths.
+    uint32_t filename_data_size;
+    uint64_t filenames_off;
+} __attribute__((packed));
+
+struct file_header {
+    uint32_t tree;
+    // Offset of the file's file_contents
+    uint64_t content_off;
 } __attribute__((packed));
 
+// chunk_header.flags
+enum {
+    // The chunk's data is not followed by a suffix array, and
+    // searches scan it.
+    kChunkNoSuffixes = 0x1,
+};
+
 struct chunk_header {
     uint64_t data_off;
-    uint64_t files_off;
+    uint32_t flags;
+    // chunk_range ranges[nranges], uint32_t range_limits[nranges],
+    // uint32_t range_files[nrange_files]
+    uint64_t ranges_off;
     uint32_t size;
-    uint32_t nfiles;
+    uint32_t nranges;
+    uint32_t nrange_files;
+    uint32_t ntree_words;
+    uint64_t tree_bits_off;
+    // 0 if the chunk has no line_postings
+    uint64_t postings_off;
+    // 0 if the chunk has no line_directory
+    uint64_t lines_off;
 } __attribute__((packed));
 
 struct content_chunk_header {
@@ -0,0 +1,195 @@
+/********************************************************************
+ * livegrep -- bounded_queue.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_BOUNDED_QUEUE_H
+#define CODESEARCH_BOUNDED_QUEUE_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+/*
+ * A fixed-capacity multi-producer, multi-consumer queue with the same
+ * interface as thread_queue.
+ *
+ * The fast path is lock-free: a ring of cells, each carrying a sequence
+ * number that says whether it is ready to be written or read on the
+ * current lap (after Dmitry Vyukov's bounded MPMC queue). push()
+ * blocks while the queue is full and pop() while it is empty; both
+ * spin briefly before parking on a condition variable, and the other
+ * side only takes the lock to wake them if someone is parked.
+ */
+template <class T>
+class bounded_queue {
+public:
+    // `capacity' is rounded up to a power of two.
+    explicit bounded_queue(size_t capacity = 1024)
+        : closed_(false), push_waiters_(0), pop_waiters_(0) {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        mask_ = n - 1;
+        cells_.reset(new cell[n]);
+        for (size_t i = 0; i < n; ++i)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+    }
+
+    void push(const T& val) {
+        assert(!closed_.load(std::memory_order_relaxed));
+        for (int spins = 0; !try_push(val); ++spins) {
+            if (spins < kSpins) {
+                relax();
+                continue;
+            }
+            std::unique_lock<std::mutex> locked(mutex_);
+            ++push_waiters_;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (!can_push())
+                not_full_.wait(locked);
+            --push_waiters_;
+        }
+        wake(pop_waiters_, not_empty_);
+    }
+
+    void close() {
+        closed_.store(true);
+        std::unique_lock<std::mutex> locked(mutex_);
+        not_empty_.notify_all();
+    }
+
+    bool pop(T *out) {
+        for (int spins = 0;; ++spins) {
+            if (try_pop(out))
+                break;
+            if (closed_.load()) {
+                // Everything pushed before close() is visible now.
+                if (!try_pop(out))
+                    return false;
+                break;
+            }
+            if (spins < kSpins) {
+                relax();
+                continue;
+            }
+            std::unique_lock<std::mutex> locked(mutex_);
+            ++pop_waiters_;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (!can_pop() && !closed_.load())
+                not_empty_.wait(locked);
+            --pop_waiters_;
+        }
+        wake(push_waiters_, not_full_);
+        return true;
+    }
+
+    bool try_pop(T *out) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+            c = &cells_[pos & mask_];
+            intptr_t dif = intptr_t(c->seq.load(std::memory_order_acquire)) -
+                intptr_t(pos + 1);
+            if (dif == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        *out = c->val;
+        c->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+protected:
+    static const int kSpins = 128;
+
+    struct cell {
+        std::atomic<size_t> seq;
+        T val;
+    };
+
+    bool try_push(const T& val) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+            c = &cells_[pos & mask_];
+            intptr_t dif = intptr_t(c->seq.load(std::memory_order_acquire)) -
+                intptr_t(pos);
+            if (dif == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed))
+                    break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        c->val = val;
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool can_push() const {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        return cells_[pos & mask_].seq.load(std::memory_order_acquire) == pos;
+    }
+
+    bool can_pop() const {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        return cells_[pos & mask_].seq.load(std::memory_order_acquire) == pos + 1;
+    }
+
+    // Wake threads parked on `cond', if there are any. The fence pairs
+    // with the one a waiter issues after announcing itself, so either
+    // we see the waiter or it sees the change we just made.
+    void wake(std::atomic_int &waiters, std::condition_variable &cond) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) == 0)
+            return;
+        std::unique_lock<std::mutex> locked(mutex_);
+        cond.notify_all();
+    }
+
+    static void relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+    alignas(64) std::unique_ptr<cell[]> cells_;
+    size_t mask_;
+    std::atomic_bool closed_;
+
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::atomic_int push_waiters_;
+    std::atomic_int pop_waiters_;
+
+private:
+    bounded_queue(const bounded_queue&);
+    bounded_queue operator=(const bounded_queue &);
+};
+
+#endif /* CODESEARCH_BOUNDED_QUEUE_H */
@@ -1,22 +1,49 @@
 #include "metrics.h"
 
+#include <assert.h>
+#include <ctype.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <map>
 #include <mutex>
 
 namespace {
     std::mutex metrics_mtx;
     std::map<std::string, metric*> *metrics;
+    std::map<std::string, histogram*> *histograms;
+
+    std::atomic_int next_shard;
+
+    // Each thread sticks to one shard, handed out round-robin.
+    int thread_shard() {
+        static thread_local int shard = next_shard++;
+        return shard;
+    }
+
+    // Metric names use dots; Prometheus names may not.
+    std::string prometheus_name(const std::string &name) {
+        std::string out = "livegrep_";
+        for (char c : name)
+            out += isalnum((unsigned char)c) ? c : '_';
+        return out;
+    }
 };
 
 
-metric::metric(const std::string &name) {
+metric::metric(const std::string &name, kind k) : name_(name), kind_(k), val_(0) {
     std::unique_lock<std::mutex> locked(metrics_mtx);
     if (metrics == 0)
         metrics = new std::map<std::string, metric*>;
     (*metrics)[name] = this;
 }
 
+metric::~metric() {
+    std::unique_lock<std::mutex> locked(metrics_mtx);
+    auto it = metrics->find(name_);
+    if (it != metrics->end() && it->second == this)
+        metrics->erase(it);
+}
+
 
 void metric::dump_all() {
     fprintf(stderr, "== begin metrics ==\n");
@@ -25,3 +52,90 @@ void metric::dump_all() {
     }
     fprintf(stderr, "== end metrics ==\n");
 }
+
+std::string metric::dump_prometheus() {
+    std::unique_lock<std::mutex> locked(metrics_mtx);
+    std::string out;
+    char buf[256];
+    if (metrics) {
+        for (auto it = metrics->begin(); it != metrics->end(); ++it) {
+            std::string name = prometheus_name(it->first);
+            snprintf(buf, sizeof buf, "# TYPE %s %s\n%s %ld\n",
+                     name.c_str(), it->second->kind_ == kGauge ? "gauge" : "counter",
+                     name.c_str(), it->second->value());
+            out += buf;
+        }
+    }
+    if (histograms) {
+        for (auto it = histograms->begin(); it != histograms->end(); ++it) {
+            std::string name = prometheus_name(it->first);
+            histogram::snapshot snap = it->second->read();
+            out += "# TYPE " + name + " histogram\n";
+            long cumulative = 0;
+            for (size_t i = 0; i < snap.counts.size(); ++i) {
+                cumulative += snap.counts[i];
+                if (i < snap.bounds.size())
+                    snprintf(buf, sizeof buf, "%s_bucket{le=\"%ld\"} %ld\n",
+                             name.c_str(), snap.bounds[i], cumulative);
+                else
+                    snprintf(buf, sizeof buf, "%s_bucket{le=\"+Inf\"} %ld\n",
+                             name.c_str(), cumulative);
+                out += buf;
+            }
+            snprintf(buf, sizeof buf, "%s_sum %ld\n%s_count %ld\n",
+                     name.c_str(), snap.sum, name.c_str(), snap.count);
+            out += buf;
+        }
+    }
+    return out;
+}
+
+histogram::histogram(const std::string &name, long first, long factor, int n)
+    : name_(name) {
+    assert(n < kMaxBuckets);
+    for (long b = first; int(bounds_.size()) < n; b *= factor)
+        bounds_.push_back(b);
+    for (int i = 0; i < kShards; ++i) {
+        for (int j = 0; j <= n; ++j)
+            shards_[i].counts[j] = 0;
+        shards_[i].sum = 0;
+    }
+
+    std::unique_lock<std::mutex> locked(metrics_mtx);
+    if (histograms == 0)
+        histograms = new std::map<std::string, histogram*>;
+    (*histograms)[name] = this;
+}
+
+histogram::~histogram() {
+    std::unique_lock<std::mutex> locked(metrics_mtx);
+    auto it = histograms->find(name_);
+    if (it != histograms->end() && it->second == this)
+        histograms->erase(it);
+}
+
+void histogram::observe(long v) {
+    size_t i = 0;
+    while (i < bounds_.size() && v > bounds_[i])
+        ++i;
+    shard &s = shards_[thread_shard() % kShards];
+    s.counts[i].fetch_add(1, std::memory_order_relaxed);
+    s.sum.fetch_add(v, std::memory_order_relaxed);
+}
+
+histogram::snapshot histogram::read() const {
+    snapshot snap;
+    snap.bounds = bounds_;
+    snap.counts.assign(bounds_.size() + 1, 0);
+    snap.sum = 0;
+    snap.count = 0;
+    for (int i = 0; i < kShards; ++i) {
+        for (size_t j = 0; j <= bounds_.size(); ++j) {
+            long n = shards_[i].counts[j].load(std::memory_order_relaxed);
+            snap.counts[j] += n;
+            snap.count += n;
+        }
+        snap.sum += shards_[i].sum.load(std::memory_order_relaxed);
+    }
+    return snap;
+}
@@ -12,16 +12,29 @@
 
 #include <atomic>
 #include <string>
+#include <vector>
 
 class metric {
 public:
-    metric(const std::string &name);
+    enum kind {
+        // Only ever goes up.
+        kCounter,
+        // A current level, such as the number of queries in flight.
+        kGauge,
+    };
+
+    metric(const std::string &name, kind k = kCounter);
+    ~metric();
     void inc() {++val_;}
     void inc(long i) {val_ += i;}
     void dec() {--val_;}
     void dec(long i) {val_ -= i;}
+    void set(long v) {val_ = v;}
+    long value() const {return val_.load();}
 
     static void dump_all();
+    // Every metric and histogram, in the Prometheus text format.
+    static std::string dump_prometheus();
 
     class timer {
     public:
@@ -48,7 +61,55 @@ public:
     };
 
 private:
+    std::string name_;
+    kind kind_;
     std::atomic_long val_;
 };
 
+/*
+ * A distribution of observed values, in buckets whose upper bounds grow
+ * geometrically. Threads record into one of several shards, so that
+ * observe() is a few atomic adds on a cache line few other threads
+ * touch; the shards are only summed when the histogram is read.
+ */
+class histogram {
+public:
+    // Buckets are bounded by first, first * factor, ... (n of them,
+    // fewer than kMaxBuckets), then an unbounded one.
+    histogram(const std::string &name, long first, long factor, int n);
+    ~histogram();
+
+    void observe(long v);
+
+    struct snapshot {
+        std::vector<long> bounds;
+        // Per bucket, not cumulative; one more than bounds.
+        std::vector<long> counts;
+        long sum;
+        long count;
+    };
+    snapshot read() const;
+
+    const std::string &name() const {return name_;}
+
+    static const int kMaxBuckets = 32;
+
+private:
+    static const int kShards = 16;
+
+    // The counts live in the shard itself, so that each shard's cache
+    // lines are its own.
+    struct alignas(64) shard {
+        std::atomic_long counts[kMaxBuckets];
+        std::atomic_long sum;
+    };
+
+    std::string name_;
+    std::vector<long> bounds_;
+    shard shards_[kShards];
+
+    histogram(const histogram&);
+    histogram operator=(const histogram&);
+};
+
 #endif
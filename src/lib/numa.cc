@@ -0,0 +1,80 @@
+/********************************************************************
+ * livegrep -- numa.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/lib/numa.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <fstream>
+#include <string>
+
+namespace {
+    const char kNodeDir[] = "/sys/devices/system/node/";
+
+    // From <numaif.h>.
+    const int kMpolPreferred = 1;
+    const unsigned kMpolMfMove = (1 << 1);
+
+    int count_nodes() {
+        int n = 0;
+        while (access((kNodeDir + std::string("node") + std::to_string(n)).c_str(), F_OK) == 0)
+            ++n;
+        return n ? n : 1;
+    }
+
+    // Parse a sysfs cpulist like "0-3,8-11" into `set'.
+    bool parse_cpulist(const std::string &list, cpu_set_t *set) {
+        CPU_ZERO(set);
+        size_t pos = 0;
+        while (pos < list.size()) {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos)
+                end = list.size();
+            int lo, hi;
+            std::string range = list.substr(pos, end - pos);
+            int n = sscanf(range.c_str(), "%d-%d", &lo, &hi);
+            if (n < 1)
+                return false;
+            if (n == 1)
+                hi = lo;
+            for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; ++cpu)
+                CPU_SET(cpu, set);
+            pos = end + 1;
+        }
+        return CPU_COUNT(set) > 0;
+    }
+};
+
+int numa_nodes() {
+    static int nodes = count_nodes();
+    return nodes;
+}
+
+bool numa_place(void *p, size_t len, int node) {
+    if (len == 0 || node >= 64)
+        return false;
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = uintptr_t(p) & ~uintptr_t(page - 1);
+    len += uintptr_t(p) - start;
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, start, len, kMpolPreferred, &mask,
+                   sizeof(mask) * 8, kMpolMfMove) == 0;
+}
+
+bool numa_pin_thread(int node, cpu_set_t *old) {
+    std::ifstream in(kNodeDir + std::string("node") + std::to_string(node) + "/cpulist");
+    std::string list;
+    cpu_set_t set;
+    if (!std::getline(in, list) || !parse_cpulist(list, &set))
+        return false;
+    if (old && sched_getaffinity(0, sizeof(*old), old) != 0)
+        return false;
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
@@ -0,0 +1,31 @@
+/********************************************************************
+ * livegrep -- numa.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_NUMA_H
+#define CODESEARCH_NUMA_H
+
+#include <stddef.h>
+#include <sched.h>
+
+/*
+ * Just enough NUMA support to place chunks and pin search threads,
+ * read from sysfs and done with raw system calls so that we need no
+ * libnuma. On machines without NUMA everything is node 0.
+ */
+
+// The number of NUMA nodes (at least 1).
+int numa_nodes();
+
+// Ask the kernel to place the pages of [p, p + len) on `node', moving
+// any that are already resident. Returns false on failure.
+bool numa_place(void *p, size_t len, int node);
+
+// Restrict the calling thread to the CPUs of `node'. If `old' is
+// non-NULL, the thread's previous affinity is saved there.
+bool numa_pin_thread(int node, cpu_set_t *old);
+
+#endif /* CODESEARCH_NUMA_H */
@@ -0,0 +1,102 @@
+/********************************************************************
+ * livegrep -- object_arena.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_OBJECT_ARENA_H
+#define CODESEARCH_OBJECT_ARENA_H
+
+#include <stddef.h>
+
+#include <mutex>
+#include <vector>
+
+/*
+ * Hands out T's from blocks of kBlockSize, for objects that all die
+ * together. Nothing is freed individually; reset() makes every block
+ * available again, so an arena that is reused allocates nothing once it
+ * has grown to its working size.
+ *
+ * T must be default-constructible and assignable; alloc() returns a
+ * freshly assigned T().
+ *
+ * get() and put() keep a process-wide free list of arenas, so that
+ * short-lived owners (e.g. one search) can reuse the blocks of earlier
+ * ones.
+ */
+template <class T>
+class object_arena {
+public:
+    object_arena() : block_(0), used_(0) {}
+
+    ~object_arena() {
+        for (auto it = blocks_.begin(); it != blocks_.end(); ++it)
+            delete[] *it;
+    }
+
+    T *alloc() {
+        if (used_ == kBlockSize) {
+            ++block_;
+            used_ = 0;
+        }
+        if (block_ == blocks_.size())
+            blocks_.push_back(new T[kBlockSize]);
+        T *out = &blocks_[block_][used_++];
+        *out = T();
+        return out;
+    }
+
+    void reset() {
+        block_ = 0;
+        used_ = 0;
+    }
+
+    static object_arena *get() {
+        std::unique_lock<std::mutex> locked(pool_mutex());
+        std::vector<object_arena*> &pool = free_pool();
+        if (pool.empty())
+            return new object_arena;
+        object_arena *out = pool.back();
+        pool.pop_back();
+        return out;
+    }
+
+    // Return `arena' to the free list. Anything it handed out is dead.
+    static void put(object_arena *arena) {
+        arena->reset();
+        while (arena->blocks_.size() > kMaxRetainedBlocks) {
+            delete[] arena->blocks_.back();
+            arena->blocks_.pop_back();
+        }
+        std::unique_lock<std::mutex> locked(pool_mutex());
+        free_pool().push_back(arena);
+    }
+
+protected:
+    static const size_t kBlockSize = 64;
+    // Blocks an arena keeps when it is returned to the free list; an
+    // outsized result set should not pin its memory forever.
+    static const size_t kMaxRetainedBlocks = 16;
+
+    static std::mutex &pool_mutex() {
+        static std::mutex mtx;
+        return mtx;
+    }
+
+    static std::vector<object_arena*> &free_pool() {
+        static std::vector<object_arena*> pool;
+        return pool;
+    }
+
+    std::vector<T*> blocks_;
+    size_t block_;
+    size_t used_;
+
+private:
+    object_arena(const object_arena&);
+    object_arena operator=(const object_arena &);
+};
+
+#endif /* CODESEARCH_OBJECT_ARENA_H */
@@ -0,0 +1,52 @@
+/********************************************************************
+ * livegrep -- probes.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_PROBES_H
+#define CODESEARCH_PROBES_H
+
+/*
+ * Statically defined tracepoints (USDT), for perf, bpftrace and
+ * SystemTap, under the provider "livegrep". Unlike uprobes on function
+ * symbols, they stay put however the compiler inlines the code around
+ * them. A probe nobody is tracing is a single nop.
+ *
+ * Probes are compiled in only when LIVEGREP_USDT is defined (`bazel
+ * build --define usdt=1', which needs <sys/sdt.h> from systemtap's
+ * sdt headers). Otherwise they expand to nothing and their arguments
+ * are not evaluated. Either way, keep arguments cheap.
+ *
+ * A double underscore in a probe name reads as a dash, so that
+ * PROBE(query__start, ...) is livegrep:query-start. The probes are:
+ *
+ *   query__start(trace_id, line_pattern)
+ *   query__done(trace_id, matches, exit_reason)
+ *   chunk__start(chunk_id)
+ *   chunk__done(chunk_id, mode)  0 skipped, 1 indexed, 2 scanned whole
+ *   chunk__candidates(chunk_id, candidates)
+ *   try__match__batch(files)     candidate files for a matching line
+ *   index__file(tree, path, bytes)
+ *   chunk__finalize__start(chunk_id, bytes)
+ *   chunk__finalize__done(chunk_id)
+ *   load__start(path)
+ *   load__metadata__done(files, chunks)
+ *   load__chunk(chunk_id)
+ *   load__done(chunks)
+ */
+#ifdef LIVEGREP_USDT
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(livegrep, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) do {} while (0)
+#endif
+
+enum probe_chunk_mode {
+    kProbeChunkSkipped = 0,
+    kProbeChunkIndexed = 1,
+    kProbeChunkScanned = 2,
+};
+
+#endif /* CODESEARCH_PROBES_H */
@@ -0,0 +1,64 @@
+/********************************************************************
+ * livegrep -- query_trace.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "query_trace.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace {
+    int thread_id() {
+        static thread_local int tid = syscall(SYS_gettid);
+        return tid;
+    }
+};
+
+query_trace::query_trace()
+    : start_(std::chrono::steady_clock::now()), dropped_(0) {
+}
+
+int64_t query_trace::now() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_).count();
+}
+
+void query_trace::add(const char *name, int64_t start, int64_t end,
+                      const char *arg, long val) {
+    event e = {name, thread_id(), start, end - start, arg, val};
+    std::unique_lock<std::mutex> locked(mtx_);
+    if (events_.size() >= kMaxEvents) {
+        ++dropped_;
+        return;
+    }
+    events_.push_back(e);
+}
+
+std::string query_trace::json() const {
+    std::unique_lock<std::mutex> locked(mtx_);
+    std::string out = "{\"traceEvents\":[";
+    char buf[256];
+    for (size_t i = 0; i < events_.size(); ++i) {
+        const event &e = events_[i];
+        snprintf(buf, sizeof buf,
+                 "%s\n{\"name\":\"%s\",\"cat\":\"search\",\"ph\":\"X\","
+                 "\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld",
+                 i ? "," : "", e.name, e.tid,
+                 (long long)e.start, (long long)e.dur);
+        out += buf;
+        if (e.arg) {
+            snprintf(buf, sizeof buf, ",\"args\":{\"%s\":%ld}", e.arg, e.val);
+            out += buf;
+        }
+        out += "}";
+    }
+    snprintf(buf, sizeof buf,
+             "],\n\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%ld}}\n",
+             dropped_);
+    out += buf;
+    return out;
+}
@@ -0,0 +1,91 @@
+/********************************************************************
+ * livegrep -- query_trace.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_QUERY_TRACE_H
+#define CODESEARCH_QUERY_TRACE_H
+
+#include <stdint.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * A timeline of one query: spans of work, each on the thread that did
+ * it, written out in the Chrome trace event format so it can be loaded
+ * into chrome://tracing or Perfetto. Tracing is opt-in per query;
+ * code that records spans does nothing when handed a NULL trace.
+ *
+ * Span names and argument names must be string literals.
+ */
+class query_trace {
+public:
+    // Spans past this many are counted but not kept.
+    static const size_t kMaxEvents = 100000;
+
+    query_trace();
+
+    // Microseconds since the trace began.
+    int64_t now() const;
+
+    void add(const char *name, int64_t start, int64_t end,
+             const char *arg = NULL, long val = 0);
+
+    std::string json() const;
+
+    // A span from construction to destruction on the calling thread.
+    class span {
+    public:
+        span(query_trace *trace, const char *name)
+            : trace_(trace), name_(name), arg_(NULL), val_(0) {
+            if (trace_)
+                start_ = trace_->now();
+        }
+
+        // Attach a numeric argument, shown with the span.
+        void set(const char *arg, long val) {
+            arg_ = arg;
+            val_ = val;
+        }
+
+        ~span() {
+            if (trace_)
+                trace_->add(name_, start_, trace_->now(), arg_, val_);
+        }
+
+    private:
+        query_trace *trace_;
+        const char *name_;
+        const char *arg_;
+        long val_;
+        int64_t start_;
+
+        span(const span&);
+        span operator=(const span&);
+    };
+
+private:
+    struct event {
+        const char *name;
+        int tid;
+        int64_t start;
+        int64_t dur;
+        const char *arg;
+        long val;
+    };
+
+    std::chrono::steady_clock::time_point start_;
+    mutable std::mutex mtx_;
+    std::vector<event> events_;
+    long dropped_;
+
+    query_trace(const query_trace&);
+    query_trace operator=(const query_trace&);
+};
+
+#endif /* CODESEARCH_QUERY_TRACE_H */
@@ -8,6 +8,8 @@
 #ifndef CODESEARCH_TIMER_H
 #define CODESEARCH_TIMER_H
 #include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
 #include <assert.h>
 #include <mutex>
 
@@ -145,4 +147,26 @@ inline static long timeval_ms(struct timeval tv) {
     return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+/*
+ * A cheap monotonic clock, in nanoseconds. The coarse clock is read
+ * from the vDSO without a system call and advances once per tick (a
+ * few milliseconds at most), which is plenty for timeouts.
+ */
+inline static int64_t coarse_monotonic_ns() {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// The precise monotonic clock, in nanoseconds.
+inline static int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
 #endif
@@ -0,0 +1,132 @@
+/********************************************************************
+ * livegrep -- line_directory.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/line_directory.h"
+
+#include <assert.h>
+
+#include <algorithm>
+
+namespace {
+    const int kWordsPerBlock = 8;
+    const int kSelectSample  = 64;
+
+    int popcount(uint64_t w) {
+        return __builtin_popcountll(w);
+    }
+
+    // The position of the `r'th (0-based) set bit of `w'.
+    int select_in_word(uint64_t w, int r) {
+        while (r--)
+            w &= w - 1;
+        return __builtin_ctzll(w);
+    }
+};
+
+line_directory::line_directory()
+    : size_(0), nnewlines_(0), nwords_(0), nblocks_(0), nsamples_(0),
+      words_(0), block_rank_(0), samples_(0) {
+}
+
+/*
+ * The serialized form is
+ *   uint64_t size;
+ *   uint64_t nnewlines;
+ *   uint64_t words[nwords];
+ *   uint32_t block_rank[nblocks + 1];
+ *   uint32_t samples[nsamples];
+ * where the array sizes are derived from size and nnewlines by
+ * layout().
+ */
+line_directory::line_directory(const uint8_t *mapped) {
+    const uint64_t *hdr = reinterpret_cast<const uint64_t*>(mapped);
+    size_ = hdr[0];
+    nnewlines_ = hdr[1];
+    layout();
+    words_ = hdr + 2;
+    block_rank_ = reinterpret_cast<const uint32_t*>(words_ + nwords_);
+    samples_ = block_rank_ + nblocks_ + 1;
+}
+
+void line_directory::layout() {
+    nwords_ = (size_ + 63) / 64;
+    nblocks_ = (nwords_ + kWordsPerBlock - 1) / kWordsPerBlock;
+    nsamples_ = (nnewlines_ + kSelectSample - 1) / kSelectSample + 1;
+}
+
+uint64_t line_directory::mapped_size() const {
+    return sizeof(uint64_t) * (2 + nwords_) +
+        sizeof(uint32_t) * (nblocks_ + 1 + nsamples_);
+}
+
+void line_directory::build(const unsigned char *data, uint32_t size) {
+    size_ = size;
+    words_buf_.assign((size + 63) / 64, 0);
+    nnewlines_ = 0;
+    for (uint32_t i = 0; i < size; ++i) {
+        if (data[i] == '\n') {
+            words_buf_[i / 64] |= uint64_t(1) << (i % 64);
+            ++nnewlines_;
+        }
+    }
+    layout();
+
+    block_rank_buf_.resize(nblocks_ + 1);
+    samples_buf_.clear();
+    uint32_t seen = 0;
+    for (uint32_t b = 0; b < nblocks_; ++b) {
+        block_rank_buf_[b] = seen;
+        uint32_t n = 0;
+        for (uint32_t w = b * kWordsPerBlock;
+             w < std::min(nwords_, (b + 1) * kWordsPerBlock); ++w)
+            n += popcount(words_buf_[w]);
+        // Record this block for every sampled newline it holds.
+        while (samples_buf_.size() * kSelectSample < seen + n)
+            samples_buf_.push_back(b);
+        seen += n;
+    }
+    assert(seen == nnewlines_);
+    block_rank_buf_[nblocks_] = seen;
+    samples_buf_.push_back(nblocks_ ? nblocks_ - 1 : 0);
+    assert(samples_buf_.size() == nsamples_);
+
+    words_ = words_buf_.data();
+    block_rank_ = block_rank_buf_.data();
+    samples_ = samples_buf_.data();
+}
+
+uint32_t line_directory::rank(uint32_t pos) const {
+    assert(pos <= size_);
+    uint32_t w = pos / 64;
+    uint32_t r = block_rank_[w / kWordsPerBlock];
+    for (uint32_t i = w - w % kWordsPerBlock; i < w; ++i)
+        r += popcount(words_[i]);
+    if (pos % 64)
+        r += popcount(words_[w] & ((uint64_t(1) << (pos % 64)) - 1));
+    return r;
+}
+
+uint32_t line_directory::select(uint32_t id) const {
+    if (id >= nnewlines_)
+        return size_;
+    // The block holding newline `id' lies between the sampled blocks
+    // on either side of it.
+    uint32_t lo = samples_[id / kSelectSample];
+    uint32_t hi = samples_[id / kSelectSample + 1];
+    const uint32_t *it = std::upper_bound(block_rank_ + lo,
+                                          block_rank_ + hi + 1, id);
+    uint32_t b = it - block_rank_ - 1;
+    uint32_t r = id - block_rank_[b];
+    for (uint32_t w = b * kWordsPerBlock; w < nwords_; ++w) {
+        uint32_t n = popcount(words_[w]);
+        if (r < n)
+            return w * 64 + select_in_word(words_[w], r);
+        r -= n;
+    }
+    assert(0);
+    return size_;
+}
@@ -0,0 +1,83 @@
+/********************************************************************
+ * livegrep -- line_directory.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_LINE_DIRECTORY_H
+#define CODESEARCH_LINE_DIRECTORY_H
+
+#include <stdint.h>
+
+#include <vector>
+
+/*
+ * A succinct index of the newlines in a chunk's data, answering line
+ * boundary queries in constant time instead of scanning with
+ * memchr()/memrchr().
+ *
+ * It is a bitvector with one bit per byte of data, set on newlines,
+ * plus a rank directory (the number of newlines before each 512-bit
+ * block) and, for select, the block holding every 64th newline.
+ *
+ * Line ids are dense and in order of position: line `i' is terminated
+ * by the `i'th newline, so rank(pos) is the id of the line holding
+ * `pos'.
+ */
+class line_directory {
+public:
+    line_directory();
+    explicit line_directory(const uint8_t *mapped);
+
+    void build(const unsigned char *data, uint32_t size);
+
+    // The number of newlines in data[0, pos).
+    uint32_t rank(uint32_t pos) const;
+    // The position of newline number `id', or size if there is none.
+    uint32_t select(uint32_t id) const;
+
+    // The position of the last newline before `pos', or 0.
+    uint32_t newline_before(uint32_t pos) const {
+        uint32_t id = rank(pos);
+        return id ? select(id - 1) : 0;
+    }
+
+    // The position of the first newline at or after `pos', or size.
+    uint32_t newline_after(uint32_t pos) const {
+        return select(rank(pos));
+    }
+
+    uint32_t nlines() const {
+        return nnewlines_;
+    }
+
+    // Size in bytes of the serialized form read by line_directory(mapped).
+    uint64_t mapped_size() const;
+
+protected:
+    void layout();
+
+    uint32_t size_;
+    uint32_t nnewlines_;
+    uint32_t nwords_;
+    uint32_t nblocks_;
+    uint32_t nsamples_;
+
+    const uint64_t *words_;
+    const uint32_t *block_rank_;
+    const uint32_t *samples_;
+
+    // Backing storage when built in memory.
+    std::vector<uint64_t> words_buf_;
+    std::vector<uint32_t> block_rank_buf_;
+    std::vector<uint32_t> samples_buf_;
+
+    friend class codesearch_index;
+
+private:
+    line_directory(const line_directory&);
+    void operator=(const line_directory&);
+};
+
+#endif /* CODESEARCH_LINE_DIRECTORY_H */
@@ -0,0 +1,118 @@
+/********************************************************************
+ * livegrep -- page_profile.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/lib/debug.h"
+
+#include "src/page_profile.h"
+#include "src/codesearch.h"
+#include "src/chunk.h"
+#include "src/chunk_allocator.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+    const char *region_names[] = {"data", "suffixes", "ranges", "content"};
+
+    size_t pages(size_t bytes) {
+        return (bytes + page_profile::kPageSize - 1) / page_profile::kPageSize;
+    }
+};
+
+page_profile::page_profile(code_searcher *cs, const std::string &path, int interval)
+    : path_(path), interval_(interval), done_(false) {
+    chunk_allocator *alloc = cs->alloc();
+    chunks_.resize(alloc->size() * kChunkRegions);
+    for (auto it = alloc->begin(); it != alloc->end(); ++it) {
+        const chunk *c = *it;
+        size_t ranges = (sizeof(chunk_range) + sizeof(uint32_t)) * c->nranges;
+        for (uint32_t i = 0; i < c->nranges; i++)
+            ranges += sizeof(uint32_t) * c->ranges[i].count;
+        std::vector<std::atomic<uint32_t>> *regions = &chunks_[c->id * kChunkRegions];
+        regions[kData] = std::vector<std::atomic<uint32_t>>(pages(c->size));
+        if (c->suffixes)
+            regions[kSuffixes] = std::vector<std::atomic<uint32_t>>
+                (pages(c->size * sizeof(uint32_t)));
+        regions[kRanges] = std::vector<std::atomic<uint32_t>>(pages(ranges));
+    }
+
+    size_t i = 0;
+    for (auto it = alloc->begin_content(); it != alloc->end_content(); ++it, ++i) {
+        content_.push_back(std::make_pair(const_cast<const uint8_t*>(it->data), i));
+        content_pages_.emplace_back(pages(it->end - it->data));
+    }
+    std::sort(content_.begin(), content_.end());
+
+    if (interval_ > 0)
+        writer_ = std::thread(&page_profile::writer, this);
+}
+
+page_profile::~page_profile() {
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        done_ = true;
+        cond_.notify_all();
+    }
+    if (writer_.joinable())
+        writer_.join();
+    write(path_);
+}
+
+void page_profile::touch_content(const void *p, size_t len) {
+    const uint8_t *start = static_cast<const uint8_t*>(p);
+    auto it = std::upper_bound(content_.begin(), content_.end(),
+                               std::make_pair(start, size_t(-1)));
+    if (it == content_.begin() || len == 0)
+        return;
+    --it;
+    std::vector<std::atomic<uint32_t>> &counts = content_pages_[it->second];
+    size_t off = start - it->first;
+    for (size_t p = off / kPageSize;
+         p <= (off + len - 1) / kPageSize && p < counts.size(); ++p)
+        counts[p].fetch_add(1, std::memory_order_relaxed);
+}
+
+void page_profile::writer() {
+    std::unique_lock<std::mutex> locked(mtx_);
+    while (!done_) {
+        cond_.wait_for(locked, std::chrono::seconds(interval_));
+        if (!done_)
+            write(path_);
+    }
+}
+
+/*
+ * Write to a temporary file and rename it into place, so a reader never
+ * sees a partial profile.
+ */
+void page_profile::write(const std::string &path) {
+    std::string tmp = path + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "w");
+    if (!out) {
+        perror(tmp.c_str());
+        return;
+    }
+    fprintf(out, "page_profile %lu\n", (unsigned long)kPageSize);
+    auto dump = [out](const char *kind, size_t index, int r,
+                      std::vector<std::atomic<uint32_t>> &counts) {
+        fprintf(out, "region %s %lu %s %lu\n", kind, (unsigned long)index,
+                region_names[r], (unsigned long)counts.size());
+        for (size_t p = 0; p < counts.size(); ++p) {
+            uint32_t n = counts[p].load(std::memory_order_relaxed);
+            if (n)
+                fprintf(out, "%lu %u\n", (unsigned long)p, n);
+        }
+    };
+    for (size_t i = 0; i < chunks_.size(); ++i)
+        dump("chunk", i / kChunkRegions, i % kChunkRegions, chunks_[i]);
+    for (size_t i = 0; i < content_pages_.size(); ++i)
+        dump("content", i, kContent, content_pages_[i]);
+    if (fclose(out) != 0 || rename(tmp.c_str(), path.c_str()) != 0)
+        perror(path.c_str());
+}
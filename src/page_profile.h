@@ -0,0 +1,100 @@
+/********************************************************************
+ * livegrep -- page_profile.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_PAGE_PROFILE_H
+#define CODESEARCH_PAGE_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/chunk.h"
+
+class code_searcher;
+
+/*
+ * Counts how often searches touch each page of an index, by region, so
+ * that we can tell how much of an index the real query mix needs in
+ * memory. Offsets are those of the dumped index layout, whether or not
+ * the index was loaded from one.
+ *
+ * Counts are written as text to a file periodically and when the
+ * profile is destroyed; tools/page-profile turns them into a
+ * working-set curve and a heatmap. The format is
+ *
+ *   page_profile <page size>
+ *   region <chunk|content> <index> <name> <pages>
+ *   <page> <count>          (one line per touched page)
+ */
+class page_profile {
+public:
+    enum region {
+        kData,
+        kSuffixes,
+        // chunk_range entries, range_limits and range_files, as they
+        // are laid out in a dumped index.
+        kRanges,
+        kContent,
+        kNumRegions,
+    };
+    // The regions that belong to a chunk.
+    static const int kChunkRegions = kContent;
+    static const size_t kPageSize = 4096;
+
+    // Write the counts to `path' every `interval' seconds (if positive).
+    page_profile(code_searcher *cs, const std::string &path, int interval);
+    ~page_profile();
+
+    void touch(const chunk *c, region r, size_t off) {
+        std::vector<std::atomic<uint32_t>> &pages = chunks_[c->id * kChunkRegions + r];
+        size_t page = off / kPageSize;
+        if (page < pages.size())
+            pages[page].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void touch(const chunk *c, region r, size_t off, size_t len) {
+        if (len == 0)
+            return;
+        for (size_t p = off / kPageSize; p <= (off + len - 1) / kPageSize; ++p)
+            touch(c, r, p * kPageSize);
+    }
+
+    // Record a read of [p, p + len) in a content chunk.
+    void touch_content(const void *p, size_t len);
+
+    void write(const std::string &path);
+
+protected:
+    void writer();
+
+    // Pages per chunk and region, indexed by chunk id * kChunkRegions
+    // + region.
+    std::vector<std::vector<std::atomic<uint32_t>>> chunks_;
+    // Content chunks, sorted by address, and their pages.
+    std::vector<std::pair<const uint8_t*, size_t>> content_;
+    std::vector<std::vector<std::atomic<uint32_t>>> content_pages_;
+
+    std::string path_;
+    int interval_;
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    bool done_;
+    std::thread writer_;
+
+private:
+    page_profile(const page_profile&);
+    page_profile operator=(const page_profile&);
+};
+
+#endif /* CODESEARCH_PAGE_PROFILE_H */
@@ -0,0 +1,137 @@
+/********************************************************************
+ * livegrep -- postings.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/postings.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+    void put_varint(std::vector<uint8_t> *out, uint32_t v) {
+        while (v >= 0x80) {
+            out->push_back(uint8_t(v) | 0x80);
+            v >>= 7;
+        }
+        out->push_back(uint8_t(v));
+    }
+
+    uint32_t get_varint(const uint8_t **p) {
+        uint32_t v = 0;
+        int shift = 0;
+        while (**p & 0x80) {
+            v |= uint32_t(**p & 0x7f) << shift;
+            shift += 7;
+            ++*p;
+        }
+        v |= uint32_t(**p) << shift;
+        ++*p;
+        return v;
+    }
+};
+
+line_postings::line_postings()
+    : nlines_(0), line_off_(0), post_off_(0), data_(0) {
+}
+
+/*
+ * The serialized form is
+ *   uint64_t nlines;
+ *   uint64_t post_off[nlines + 1];
+ *   uint32_t line_off[nlines];
+ *   uint8_t  data[post_off[nlines]];
+ */
+line_postings::line_postings(const uint8_t *mapped) {
+    nlines_ = *reinterpret_cast<const uint64_t*>(mapped);
+    post_off_ = reinterpret_cast<const uint64_t*>(mapped + sizeof(uint64_t));
+    line_off_ = reinterpret_cast<const uint32_t*>(post_off_ + nlines_ + 1);
+    data_ = reinterpret_cast<const uint8_t*>(line_off_ + nlines_);
+}
+
+uint64_t line_postings::mapped_size() const {
+    return sizeof(uint64_t) * (nlines_ + 2) + sizeof(uint32_t) * nlines_ +
+        post_off_[nlines_];
+}
+
+void line_postings::add(uint32_t off, const line_posting &p) {
+    pending_.push_back(std::make_pair(off, p));
+}
+
+void line_postings::finalize(const unsigned char *data, uint32_t size) {
+    const unsigned char *p = data, *end = data + size;
+    while (p < end) {
+        line_off_buf_.push_back(p - data);
+        p = static_cast<const unsigned char*>(memchr(p, '\n', end - p));
+        if (p == NULL)
+            break;
+        ++p;
+    }
+    nlines_ = line_off_buf_.size();
+    line_off_ = line_off_buf_.data();
+
+    // Bucket the pending postings by line id. Postings were added in
+    // order of file and line number, so a stable counting sort leaves
+    // each line's postings sorted.
+    std::vector<uint32_t> ids(pending_.size());
+    std::vector<uint32_t> start(nlines_ + 1, 0);
+    for (size_t i = 0; i < pending_.size(); ++i) {
+        int id = line_id(pending_[i].first);
+        assert(id >= 0);
+        ids[i] = id;
+        ++start[id + 1];
+    }
+    for (uint32_t i = 0; i < nlines_; ++i)
+        start[i + 1] += start[i];
+    std::vector<line_posting> sorted(pending_.size());
+    for (size_t i = 0; i < pending_.size(); ++i)
+        sorted[start[ids[i]]++] = pending_[i].second;
+    std::vector<std::pair<uint32_t, line_posting> >().swap(pending_);
+
+    post_off_buf_.reserve(nlines_ + 1);
+    auto it = sorted.begin();
+    for (uint32_t id = 0; id < nlines_; ++id) {
+        post_off_buf_.push_back(data_buf_.size());
+        line_posting prev = {0, 0, 0};
+        for (; it != sorted.begin() + start[id]; ++it) {
+            assert(it->file >= prev.file);
+            assert(it->piece < it->lno);
+            if (it->file != prev.file)
+                prev.lno = 0;
+            put_varint(&data_buf_, it->file - prev.file);
+            put_varint(&data_buf_, it->lno - prev.lno);
+            put_varint(&data_buf_, it->lno - 1 - it->piece);
+            prev = *it;
+        }
+    }
+    post_off_buf_.push_back(data_buf_.size());
+    post_off_ = post_off_buf_.data();
+    data_ = data_buf_.data();
+}
+
+int line_postings::line_id(uint32_t off) const {
+    const uint32_t *it = std::upper_bound(line_off_, line_off_ + nlines_, off);
+    if (it == line_off_ || *(it - 1) != off)
+        return -1;
+    return it - line_off_ - 1;
+}
+
+void line_postings::decode(int id, std::vector<line_posting> *out) const {
+    assert(id >= 0 && uint32_t(id) < nlines_);
+    const uint8_t *p = data_ + post_off_[id];
+    const uint8_t *end = data_ + post_off_[id + 1];
+    line_posting cur = {0, 0, 0};
+    while (p < end) {
+        uint32_t delta = get_varint(&p);
+        if (delta != 0)
+            cur.lno = 0;
+        cur.file += delta;
+        cur.lno += get_varint(&p);
+        cur.piece = cur.lno - 1 - get_varint(&p);
+        out->push_back(cur);
+    }
+}
@@ -0,0 +1,80 @@
+/********************************************************************
+ * livegrep -- postings.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_POSTINGS_H
+#define CODESEARCH_POSTINGS_H
+
+#include <stdint.h>
+
+#include <vector>
+#include <utility>
+
+/*
+ * One occurrence of a chunk line in the corpus: file number, 1-based
+ * line number, and the index of the file_contents piece holding it.
+ */
+struct line_posting {
+    uint32_t file;
+    uint32_t lno;
+    uint32_t piece;
+};
+
+/*
+ * An exact map from each line stored in a chunk's data to every place
+ * that line occurs in the corpus.
+ *
+ * Each line of the chunk gets a dense id, in order of position; line
+ * `i' starts at line_off_[i]. Its postings are sorted by file and line
+ * number, and varint-encoded as deltas in
+ * data_[post_off_[i], post_off_[i + 1]).
+ *
+ * Postings are collected by add() while files are indexed and encoded
+ * by finalize(). A loaded index points line_postings directly into its
+ * mapping instead.
+ */
+class line_postings {
+public:
+    line_postings();
+    explicit line_postings(const uint8_t *mapped);
+
+    void add(uint32_t off, const line_posting &p);
+    void finalize(const unsigned char *data, uint32_t size);
+
+    // Returns the id of the line starting at `off', or -1.
+    int line_id(uint32_t off) const;
+    void decode(int id, std::vector<line_posting> *out) const;
+
+    uint32_t nlines() const {
+        return nlines_;
+    }
+
+    // Size in bytes of the serialized form read by line_postings(mapped).
+    uint64_t mapped_size() const;
+
+protected:
+    // Transient during index construction: (line offset, posting), in
+    // the order they were added.
+    std::vector<std::pair<uint32_t, line_posting> > pending_;
+
+    uint32_t nlines_;
+    const uint32_t *line_off_;
+    const uint64_t *post_off_;
+    const uint8_t *data_;
+
+    // Backing storage when built in memory.
+    std::vector<uint32_t> line_off_buf_;
+    std::vector<uint64_t> post_off_buf_;
+    std::vector<uint8_t> data_buf_;
+
+    friend class codesearch_index;
+
+private:
+    line_postings(const line_postings&);
+    void operator=(const line_postings&);
+};
+
+#endif /* CODESEARCH_POSTINGS_H */
@@ -91,7 +91,6 @@ bool tag_searcher::transform(query *q, match_result *m) const {
     // iterate through the lines to add context information
     auto line_it = file->content->begin(file_alloc_);
     auto line_end = file->content->end(file_alloc_);
-    const int kContextLines = 3;
     m->file = file;
 
     // jump to context before
@@ -102,7 +101,7 @@ bool tag_searcher::transform(query *q, match_result *m) const {
     // context before (we reverse the order to match codesearch)
     m->context_before.clear();
     for (; current < m->lno; ++current) {
-        m->context_before.insert(m->context_before.begin(), *line_it);
+        m->context_before.push_front(*line_it);
         ++line_it;
     }
 
@@ -18,6 +18,7 @@
 #include "src/tools/transport.h"
 #include "src/tools/limits.h"
 #include "src/tools/grpc_server.h"
+#include "src/tools/slow_queries.h"
 
 #include <stdio.h>
 #include <sys/socket.h>
@@ -26,7 +27,10 @@
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <semaphore.h>
+#include <signal.h>
 
+#include <atomic>
+#include <fstream>
 #include <iostream>
 #include <functional>
 #include <future>
@@ -52,6 +56,15 @@ DEFINE_bool(quiet, false, "Do the search, but don't print results.");
 DEFINE_bool(index_only, false, "Build the index and don't serve queries");
 DEFINE_string(grpc, "localhost:9999", "GRPC listener address");
 DEFINE_bool(reload_rpc, false, "Enable the Reload RPC");
+DEFINE_bool(progressive_load, false, "Serve queries while --load_index is still loading, over the part of the index loaded so far.");
+DEFINE_bool(hot_reload, false, "Make the Reload RPC load the new index alongside the one being served and switch to it, instead of restarting the server.");
+DEFINE_bool(reload_warm, true, "With --hot_reload, read a loaded index into memory before switching to it.");
+DEFINE_bool(prefault, false, "Read all of a --load_index index into memory before serving it.");
+DEFINE_bool(mlock_index, false, "mlock() the parts of a loaded index that every search reads, so they are never paged out.");
+DEFINE_int32(mlock_sa_levels, 10, "With --mlock_index, also lock the suffix-array pages read by the first this many steps of a search.");
+DEFINE_string(page_profile, "", "Count the index pages searches touch, and write the counts to this file (see codesearchtool page-profile). With --hot_reload, each index gets its own file, this path suffixed with .<reload number>.");
+DEFINE_int32(page_profile_interval, 60, "Seconds between writes of --page_profile.");
+DEFINE_string(warmup_queries, "", "Run each line of this file as a search before reporting ready.");
 
 using namespace std;
 using namespace re2;
@@ -119,8 +132,89 @@ void build_index(code_searcher *cs, const vector<std::string> &argv) {
     }
 }
 
+/*
+ * Run each line of --warmup_queries as a regex search, so that the
+ * pages typical queries touch are in memory before we report ready.
+ */
+void warm_up(code_searcher *search) {
+    std::ifstream in(FLAGS_warmup_queries);
+    if (!in) {
+        fprintf(stderr, "Cannot open %s\n", FLAGS_warmup_queries.c_str());
+        return;
+    }
+    RE2::Options opts;
+    default_re2_options(opts);
+    code_searcher::search_thread st(search);
+    timer tm;
+    int nqueries = 0;
+    string line;
+    while (getline(in, line)) {
+        if (line.empty())
+            continue;
+        query q = {};
+        q.max_matches = 50;
+        q.line_pat.reset(new RE2(line, opts));
+        if (!q.line_pat->ok()) {
+            fprintf(stderr, "warm-up: %s: %s\n",
+                    line.c_str(), q.line_pat->error().c_str());
+            continue;
+        }
+        match_stats stats;
+        st.match(q, [](const match_result *) {}, [](const file_result *) {}, &stats);
+        ++nqueries;
+    }
+    struct timeval elapsed = tm.elapsed();
+    log("warm-up: ran %d queries in %d.%06ds", nqueries,
+        (int)elapsed.tv_sec, (int)elapsed.tv_usec);
+}
+
+/*
+ * Apply --mlock_index, --warmup_queries and --page_profile to an index
+ * that is fully loaded, and mark it warm.
+ */
+void prepare_index(code_searcher *search) {
+    if (FLAGS_mlock_index) {
+        size_t locked = search->lock_index(FLAGS_mlock_sa_levels);
+        log("locked %lu bytes of the index in memory", (unsigned long)locked);
+    }
+    if (FLAGS_warmup_queries.size())
+        warm_up(search);
+    search->set_warm(true);
+    if (FLAGS_page_profile.size()) {
+        // Offsets only mean something for the index they were counted
+        // on, and an index being replaced still writes its counts when
+        // it is freed, so each index a hot reload loads has its own file.
+        static std::atomic_int generation;
+        string path = FLAGS_page_profile;
+        if (FLAGS_hot_reload)
+            path += "." + std::to_string(generation++);
+        search->enable_page_profile(path, FLAGS_page_profile_interval);
+    }
+}
+
+/*
+ * With --progressive_load and a `loader', `loader' is left running the
+ * rest of the load, and the caller must join it.
+ */
 void initialize_search(code_searcher *search,
-                       int argc, char **argv) {
+                       int argc, char **argv,
+                       std::thread *loader) {
+    if (loader && FLAGS_load_index.size() && FLAGS_progressive_load &&
+        !FLAGS_dump_index.size() && !FLAGS_index_only) {
+        search->begin_load_index(FLAGS_load_index);
+        search->set_warm(false);
+        log("Loaded index metadata; loading %d chunks in the background",
+            int(search->total_chunks()));
+        *loader = std::thread([search]() {
+                timer tm;
+                search->load_chunks(true);
+                struct timeval elapsed = tm.elapsed();
+                log("index loaded in %d.%06ds",
+                    (int)elapsed.tv_sec, (int)elapsed.tv_usec);
+                prepare_index(search);
+            });
+        return;
+    }
     if (FLAGS_load_index.size() == 0) {
         if (FLAGS_dump_index.size())
             search->set_alloc(make_dump_allocator(search, FLAGS_dump_index));
@@ -141,28 +235,35 @@ void initialize_search(code_searcher *search,
                 (int)elapsed.tv_sec, (int)elapsed.tv_usec);
         metric::dump_all();
     } else {
-        search->load_index(FLAGS_load_index);
+        search->begin_load_index(FLAGS_load_index);
+        search->load_chunks(FLAGS_prefault);
     }
     if (FLAGS_dump_index.size() && FLAGS_load_index.size())
         search->dump_index(FLAGS_dump_index);
+    if (!FLAGS_index_only)
+        prepare_index(search);
 }
 
-void listen_grpc(code_searcher *search, code_searcher *tags, const string& addr) {
-    promise<void> reload_request;
-    auto reload_request_ptr = FLAGS_reload_rpc ? &reload_request : NULL;
-
-    unique_ptr<CodeSearch::Service> service(build_grpc_server(search, tags, reload_request_ptr));
+void initialize_tags(unique_ptr<code_searcher> *tags) {
+    tags->reset();
+    if (FLAGS_load_tags.size() != 0) {
+        tags->reset(new code_searcher());
+        (*tags)->load_index(FLAGS_load_tags);
+    }
+}
 
+void serve(CodeSearch::Service *service, const string& addr,
+           promise<void> *reload_request) {
     ServerBuilder builder;
     builder.AddListeningPort(addr, grpc::InsecureServerCredentials());
-    builder.RegisterService(service.get());
+    builder.RegisterService(service);
     std::unique_ptr<Server> server(builder.BuildAndStart());
 
     log("Serving...");
 
-    if (FLAGS_reload_rpc) {
+    if (reload_request) {
         thread shutdown_thread([&]() {
-            reload_request.get_future().wait();
+            reload_request->get_future().wait();
             server->Shutdown();
         });
         server->Wait();
@@ -172,21 +273,97 @@ void listen_grpc(code_searcher *search, code_searcher *tags, const string& addr)
     }
 }
 
+void listen_grpc(code_searcher *search, code_searcher *tags, const string& addr) {
+    promise<void> reload_request;
+    auto reload_request_ptr = FLAGS_reload_rpc ? &reload_request : NULL;
+
+    unique_ptr<CodeSearch::Service> service(build_grpc_server(search, tags, reload_request_ptr));
+    serve(service.get(), addr, reload_request_ptr);
+}
+
+/*
+ * Serve with --hot_reload: each Reload builds or loads a new index next
+ * to the current one, and the server switches over to it.
+ */
+void listen_grpc_hot_reload(int argc, char **argv, const string& addr) {
+    unique_ptr<code_searcher> search(new code_searcher), tags;
+    std::thread loader;
+    initialize_search(search.get(), argc, argv, &loader);
+    initialize_tags(&tags);
+
+    auto reload = [argc, argv, &loader](unique_ptr<code_searcher> *search,
+                                        unique_ptr<code_searcher> *tags,
+                                        string *error) {
+        // The index being replaced may not have finished loading.
+        if (loader.joinable())
+            loader.join();
+        search->reset(new code_searcher);
+        if (FLAGS_load_index.size() && !FLAGS_dump_index.size()) {
+            // A bad index file must not take down the server that is
+            // still serving the old one.
+            if (!(*search)->begin_load_index(FLAGS_load_index, error))
+                return false;
+            (*search)->load_chunks(FLAGS_reload_warm || FLAGS_prefault);
+            prepare_index(search->get());
+        } else {
+            initialize_search(search->get(), argc, argv, NULL);
+        }
+        tags->reset();
+        if (FLAGS_load_tags.size() != 0) {
+            tags->reset(new code_searcher());
+            if (!(*tags)->begin_load_index(FLAGS_load_tags, error))
+                return false;
+            (*tags)->load_chunks(false);
+        }
+        return true;
+    };
+
+    unique_ptr<CodeSearch::Service> service(
+        build_grpc_server(std::move(search), std::move(tags), reload));
+    serve(service.get(), addr, NULL);
+    service.reset();
+    if (loader.joinable())
+        loader.join();
+}
+
+/*
+ * Write the slow query log to stderr whenever we get `sig'. The signal
+ * is blocked here, before any other thread starts, so that only the
+ * thread waiting for it ever sees it.
+ */
+void dump_slow_queries_on(int sig) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, sig);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    std::thread([set]() {
+            int got;
+            while (sigwait(&set, &got) == 0) {
+                string json = slow_queries().json();
+                fwrite(json.data(), 1, json.size(), stderr);
+            }
+        }).detach();
+}
+
 int main(int argc, char **argv) {
     gflags::SetUsageMessage("Usage: " + string(argv[0]) + " <options> REFS");
     gflags::ParseCommandLineFlags(&argc, &argv, true);
 
     signal(SIGPIPE, SIG_IGN);
+    dump_slow_queries_on(SIGUSR1);
+
+    if (FLAGS_hot_reload && !FLAGS_index_only && FLAGS_grpc.size()) {
+        listen_grpc_hot_reload(argc, argv, FLAGS_grpc);
+        return 0;
+    }
 
     while (true) {
         code_searcher search;
         unique_ptr<code_searcher> tags;
+        std::thread loader;
 
-        initialize_search(&search, argc, argv);
-        if (FLAGS_load_tags.size() != 0) {
-            tags.reset(new code_searcher());
-            tags->load_index(FLAGS_load_tags);
-        }
+        initialize_search(&search, argc, argv, &loader);
+        initialize_tags(&tags);
 
         if (FLAGS_index_only)
             return 0;
@@ -194,5 +371,7 @@ int main(int argc, char **argv) {
         if (FLAGS_grpc.size()) {
             listen_grpc(&search, tags.get(), FLAGS_grpc);
         }
+        if (loader.joinable())
+            loader.join();
     }
 }
@@ -8,6 +8,7 @@ using std::string;
 extern int analyze_re(int, char**);
 extern int dump_file(int, char**);
 extern int inspect_index(int, char**);
+extern int page_profile_report(int, char**);
 
 struct _command {
     string name;
@@ -16,6 +17,7 @@ struct _command {
     {"analyze-re", analyze_re},
     {"inspect-index", inspect_index},
     {"dump-file", dump_file},
+    {"page-profile", page_profile_report},
 };
 
 int main(int argc, char **argv) {
@@ -1,4 +1,6 @@
 #include "src/lib/debug.h"
+#include "src/lib/metrics.h"
+#include "src/lib/query_trace.h"
 #include "src/lib/timer.h"
 
 #include "src/codesearch.h"
@@ -6,16 +8,21 @@
 #include "src/re_width.h"
 
 #include "src/tools/limits.h"
+#include "src/tools/slow_queries.h"
 #include "src/tools/grpc_server.h"
 
 #include "gflags/gflags.h"
 #include <json-c/json.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <functional>
 #include <future>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 
 #include <boost/bind.hpp>
 
@@ -26,46 +33,196 @@ using grpc::StatusCode;
 using std::string;
 
 DEFINE_int32(max_matches, 50, "The default maximum number of matches to return for a single query.");
+DEFINE_int32(max_files_per_line, 0, "The default maximum number of files to return for a single matching line (0 for no limit).");
+DEFINE_int64(max_scan_bytes, 0, "The default maximum number of bytes a single query may scan with its regex (0 for no limit).");
+DEFINE_int64(max_candidates, 0, "The default maximum number of index candidates a single query may examine (0 for no limit).");
+DEFINE_int64(max_try_matches, 0, "The default maximum number of files a single query may check for a matching line (0 for no limit).");
+
+namespace {
+    metric search_queries("search.queries");
+    metric search_in_flight("search.in_flight", metric::kGauge);
+    metric search_exit_timeout("search.exit.timeout");
+    metric search_exit_match_limit("search.exit.match_limit");
+    metric search_exit_work_limit("search.exit.work_limit");
+    metric index_chunks_loaded("index.chunks_loaded", metric::kGauge);
+    metric index_chunks_total("index.chunks_total", metric::kGauge);
+
+    // Latencies in microseconds, from 100us to about 50s.
+    histogram search_latency("search.latency_us", 100, 2, 20);
+    histogram search_analyze_time("search.analyze_us", 100, 2, 20);
+    histogram search_index_time("search.index_us", 100, 2, 20);
+    histogram search_sort_time("search.sort_us", 100, 2, 20);
+    histogram search_re2_time("search.re2_us", 100, 2, 20);
+    histogram search_git_time("search.git_us", 100, 2, 20);
+    histogram search_results("search.results", 1, 2, 12);
+
+    long timeval_us(struct timeval tv) {
+        return tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+
+    // Counts a query as in flight until it returns, and records how
+    // long it took.
+    struct query_metrics {
+        query_metrics() {
+            search_queries.inc();
+            search_in_flight.inc();
+        }
+        ~query_metrics() {
+            search_in_flight.dec();
+            search_latency.observe(timeval_us(tm.elapsed()));
+        }
+        timer tm;
+    };
+};
+
+/*
+ * One index the server can search, along with the search threads bound
+ * to it. Each request holds a reference to the generation it started
+ * on, so a hot reload can replace the current generation while
+ * requests are still running against the old one; when the last of
+ * them finishes, the old one goes to the reaper thread to be freed.
+ */
+struct index_generation {
+    index_generation(code_searcher *cs, code_searcher *tagdata);
+    ~index_generation();
+
+    code_searcher::search_thread *get_thread() {
+        code_searcher::search_thread *search;
+        if (!pool.try_pop(&search))
+            search = new code_searcher::search_thread(cs);
+        return search;
+    }
+
+    void put_thread(code_searcher::search_thread *search) {
+        pool.push(search);
+    }
+
+    code_searcher *cs;
+    code_searcher *tagdata;
+    tag_searcher *tagmatch;
+    // Set if the generation owns its index.
+    std::unique_ptr<code_searcher> owned_cs;
+    std::unique_ptr<code_searcher> owned_tagdata;
+
+    thread_queue <code_searcher::search_thread*> pool;
+};
+
+index_generation::index_generation(code_searcher *cs, code_searcher *tagdata)
+    : cs(cs), tagdata(tagdata), tagmatch(nullptr) {
+    if (tagdata != nullptr) {
+        tagmatch = new tag_searcher;
+        tagmatch->cache_indexed_files(cs);
+    }
+}
+
+index_generation::~index_generation() {
+    pool.close();
+    code_searcher::search_thread* thread;
+    while (pool.pop(&thread))
+        delete thread;
+    delete tagmatch;
+}
 
 class CodeSearchImpl final : public CodeSearch::Service {
  public:
-    explicit CodeSearchImpl(code_searcher *cs, code_searcher *tagdata, std::promise<void> *reload_request);
+    explicit CodeSearchImpl(code_searcher *cs, code_searcher *tagdata,
+                            std::promise<void> *reload_request,
+                            const index_loader &loader);
     virtual ~CodeSearchImpl();
 
     virtual grpc::Status Info(grpc::ServerContext* context, const ::InfoRequest* request, ::ServerInfo* response);
-    void TagsFirstSearch_(::CodeSearchResult* response, query& q, match_stats& stats);
+    void TagsFirstSearch_(index_generation *gen, ::CodeSearchResult* response, query& q, match_stats& stats);
     virtual grpc::Status Search(grpc::ServerContext* context, const ::Query* request, ::CodeSearchResult* response);
     virtual grpc::Status Reload(grpc::ServerContext* context, const ::Empty* request, ::Empty* response);
+    virtual grpc::Status Metrics(grpc::ServerContext* context, const ::Empty* request, ::MetricsReply* response);
+    virtual grpc::Status SlowQueries(grpc::ServerContext* context, const ::Empty* request, ::SlowQueriesReply* response);
+
+    // Make the current generation own the index it was built with.
+    void adopt(std::unique_ptr<code_searcher> cs,
+               std::unique_ptr<code_searcher> tagdata) {
+        current_->owned_cs = std::move(cs);
+        current_->owned_tagdata = std::move(tagdata);
+    }
 
  private:
-    code_searcher *cs_;
-    code_searcher *tagdata_;
-    std::promise<void> *reload_request_;
-    tag_searcher *tagmatch_;
+    std::shared_ptr<index_generation> current();
+    std::shared_ptr<index_generation> new_generation(code_searcher *cs,
+                                                     code_searcher *tagdata);
+    void hot_reload();
+    void reap();
 
-    thread_queue <code_searcher::search_thread*> pool_;
+    std::promise<void> *reload_request_;
+    index_loader loader_;
+
+    // Generations no request refers to any more. Freeing one joins its
+    // search threads and unmaps its index, which is no job for whichever
+    // request thread happened to drop the last reference, so the reaper
+    // thread does it.
+    thread_queue<index_generation*> retired_;
+    std::thread reaper_;
+
+    std::mutex mtx_;
+    std::shared_ptr<index_generation> current_;
+    std::thread reloader_;
+    std::atomic_bool reloading_;
 };
 
 std::unique_ptr<CodeSearch::Service> build_grpc_server(code_searcher *cs,
                                                        code_searcher *tagdata,
                                                        std::promise<void> *reload_request) {
-    return std::unique_ptr<CodeSearch::Service>(new CodeSearchImpl(cs, tagdata, reload_request));
+    return std::unique_ptr<CodeSearch::Service>(new CodeSearchImpl(cs, tagdata, reload_request, index_loader()));
 }
 
-CodeSearchImpl::CodeSearchImpl(code_searcher *cs, code_searcher *tagdata, std::promise<void> *reload_request)
-    : cs_(cs), tagdata_(tagdata), reload_request_(reload_request), tagmatch_(nullptr) {
-    if (tagdata != nullptr) {
-        tagmatch_ = new tag_searcher;
-        tagmatch_->cache_indexed_files(cs_);
-    }
+std::unique_ptr<CodeSearch::Service> build_grpc_server(std::unique_ptr<code_searcher> cs,
+                                                       std::unique_ptr<code_searcher> tagdata,
+                                                       const index_loader &loader) {
+    CodeSearchImpl *impl = new CodeSearchImpl(cs.get(), tagdata.get(), nullptr, loader);
+    impl->adopt(std::move(cs), std::move(tagdata));
+    return std::unique_ptr<CodeSearch::Service>(impl);
+}
+
+CodeSearchImpl::CodeSearchImpl(code_searcher *cs, code_searcher *tagdata,
+                               std::promise<void> *reload_request,
+                               const index_loader &loader)
+    : reload_request_(reload_request), loader_(loader), reloading_(false) {
+    if (loader_)
+        reaper_ = std::thread(&CodeSearchImpl::reap, this);
+    current_ = new_generation(cs, tagdata);
 }
 
 CodeSearchImpl::~CodeSearchImpl() {
-    pool_.close();
-    code_searcher::search_thread* thread;
-    while (pool_.pop(&thread))
-        delete thread;
-    delete tagmatch_;
+    if (reloader_.joinable())
+        reloader_.join();
+    current_.reset();
+    retired_.close();
+    if (reaper_.joinable())
+        reaper_.join();
+}
+
+std::shared_ptr<index_generation> CodeSearchImpl::new_generation(code_searcher *cs,
+                                                                code_searcher *tagdata) {
+    index_generation *gen = new index_generation(cs, tagdata);
+    // Without hot reloads, the one generation lives as long as we do.
+    if (!loader_)
+        return std::shared_ptr<index_generation>(gen);
+    return std::shared_ptr<index_generation>(
+        gen, [this](index_generation *old) { retired_.push(old); });
+}
+
+void CodeSearchImpl::reap() {
+    index_generation *gen;
+    while (retired_.pop(&gen)) {
+        timer tm;
+        delete gen;
+        struct timeval elapsed = tm.elapsed();
+        log("freed an index generation in %d.%06ds",
+            (int)elapsed.tv_sec, (int)elapsed.tv_usec);
+    }
+}
+
+std::shared_ptr<index_generation> CodeSearchImpl::current() {
+    std::unique_lock<std::mutex> locked(mtx_);
+    return current_;
 }
 
 string trace_id_from_request(ServerContext *ctx) {
@@ -75,12 +232,20 @@ string trace_id_from_request(ServerContext *ctx) {
     return string(it->second.data(), it->second.size());
 }
 
+// Whether the client asked for a timeline of its query.
+bool query_trace_requested(ServerContext *ctx) {
+    auto it = ctx->client_metadata().find("query-trace");
+    return it != ctx->client_metadata().end() && it->second.size() > 0;
+}
+
 Status CodeSearchImpl::Info(ServerContext* context, const ::InfoRequest* request, ::ServerInfo* response) {
     scoped_trace_id trace(trace_id_from_request(context));
     log("Info()");
 
-    response->set_name(cs_->name());
-    std::vector<indexed_tree> trees = cs_->trees();
+    std::shared_ptr<index_generation> gen = current();
+    code_searcher *cs = gen->cs;
+    response->set_name(cs->name());
+    std::vector<indexed_tree> trees = cs->trees();
     for (auto it = trees.begin(); it != trees.end(); ++it) {
         auto insert = response->add_trees();
         insert->set_name(it->name);
@@ -105,8 +270,11 @@ Status CodeSearchImpl::Info(ServerContext* context, const ::InfoRequest* request
             }
         }
     }
-    response->set_has_tags(tagdata_ != nullptr);
-    response->set_index_time(cs_->index_timestamp());
+    response->set_has_tags(gen->tagdata != nullptr);
+    response->set_index_time(cs->index_timestamp());
+    response->set_chunks_loaded(cs->ready_chunks());
+    response->set_chunks_total(cs->total_chunks());
+    response->set_ready(cs->ready_chunks() == cs->total_chunks() && cs->warm());
     return Status::OK;
 }
 
@@ -165,8 +333,8 @@ class add_match {
 public:
     typedef std::set<std::pair<indexed_file*, int>> line_set;
 
-    add_match(line_set* ls, CodeSearchResult* response)
-        : unique_lines_(ls), response_(response) {}
+    add_match(line_set* ls, CodeSearchResult* response, match_stats* stats)
+        : unique_lines_(ls), response_(response), stats_(stats) {}
 
     int match_count() {
         return response_->results_size();
@@ -177,6 +345,7 @@ public:
         // tags search then again during the main corpus search.
         bool already_inserted = ! unique_lines_->insert(std::make_pair(m->file, m->lno)).second;
         if (already_inserted) {
+            stats_->work.results_deduped++;
             return;
         }
 
@@ -195,6 +364,7 @@ public:
         result->mutable_bounds()->set_left(m->matchleft);
         result->mutable_bounds()->set_right(m->matchright);
         result->set_line(m->line.ToString());
+        result->set_more_files(m->more_files);
     }
 
     void operator()(const file_result *f) const {
@@ -209,6 +379,7 @@ public:
 private:
     line_set* unique_lines_;
     CodeSearchResult* response_;
+    match_stats* stats_;
 };
 
 static void run_tags_search(const query& main_query, code_searcher *tagdata,
@@ -243,19 +414,19 @@ static std::string pat(const std::shared_ptr<RE2> &p) {
     return p->pattern();
 }
 
-void CodeSearchImpl::TagsFirstSearch_(::CodeSearchResult* response, query& q, match_stats& stats) {
+void CodeSearchImpl::TagsFirstSearch_(index_generation *gen, ::CodeSearchResult* response, query& q, match_stats& stats) {
     string line_pat = q.line_pat->pattern();
     string regex;
     int32_t original_max_matches = q.max_matches;  // remember original value
 
     add_match::line_set ls;
-    add_match cb(&ls, response);
+    add_match cb(&ls, response, &stats);
 
     /* To surface the most important matches first, start with tags.
        First pass: is the pattern an exact match for any tags? */
     regex = "^" + line_pat + "$";
     q.line_pat.reset(new RE2(regex, q.line_pat->options()));
-    run_tags_search(q, tagdata_, cb, tagmatch_, stats);
+    run_tags_search(q, gen->tagdata, cb, gen->tagmatch, stats);
 
     q.max_matches = original_max_matches - cb.match_count();
     if (q.max_matches <= 0)
@@ -264,7 +435,7 @@ void CodeSearchImpl::TagsFirstSearch_(::CodeSearchResult* response, query& q, ma
     /* Second pass: is the pattern a prefix match for any tags? */
     regex = "^" + line_pat + "[^\t]";
     q.line_pat.reset(new RE2(regex, q.line_pat->options()));
-    run_tags_search(q, tagdata_, cb, tagmatch_, stats);
+    run_tags_search(q, gen->tagdata, cb, gen->tagmatch, stats);
 
     q.max_matches = original_max_matches - cb.match_count();
     if (q.max_matches <= 0)
@@ -272,14 +443,13 @@ void CodeSearchImpl::TagsFirstSearch_(::CodeSearchResult* response, query& q, ma
 
     /* Third and final pass: full corpus search. */
     q.line_pat.reset(new RE2(line_pat, q.line_pat->options()));
-    code_searcher::search_thread *search;
-    if (!pool_.try_pop(&search))
-        search = new code_searcher::search_thread(cs_);
+    code_searcher::search_thread *search = gen->get_thread();
     search->match(q, cb, cb, &stats);
-    pool_.push(search);
+    gen->put_thread(search);
 }
 
 Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::CodeSearchResult* response) {
+    query_metrics metrics;
     WidthWalker width;
 
     scoped_trace_id trace(trace_id_from_request(context));
@@ -292,10 +462,29 @@ Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::
 
     q.trace_id = current_trace_id();
 
+    std::unique_ptr<query_trace> timeline;
+    if (query_trace_requested(context))
+        timeline.reset(new query_trace);
+    q.trace = timeline.get();
+
     q.max_matches = request->max_matches();
     if (q.max_matches <= 0 && FLAGS_max_matches)
         q.max_matches = FLAGS_max_matches;
 
+    q.max_files_per_line = request->max_files_per_line();
+    if (q.max_files_per_line <= 0)
+        q.max_files_per_line = FLAGS_max_files_per_line;
+
+    q.budget.scan_bytes = request->max_scan_bytes();
+    if (q.budget.scan_bytes <= 0)
+        q.budget.scan_bytes = FLAGS_max_scan_bytes;
+    q.budget.candidates = request->max_candidates();
+    if (q.budget.candidates <= 0)
+        q.budget.candidates = FLAGS_max_candidates;
+    q.budget.try_matches = request->max_try_matches();
+    if (q.budget.try_matches <= 0)
+        q.budget.try_matches = FLAGS_max_try_matches;
+
     log(q.trace_id,
         "processing query line='%s' file='%s' tree='%s' tags='%s' "
         "not_file='%s' not_tree='%s' not_tags='%s' max_matches='%d'",
@@ -337,23 +526,23 @@ Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::
         ;
 
     match_stats stats;
-    if (q.tags_pat == NULL && tagdata_ && might_match_tags) {
-        CodeSearchImpl::TagsFirstSearch_(response, q, stats);
+    int64_t search_start = timeline ? timeline->now() : 0;
+    std::shared_ptr<index_generation> gen = current();
+    if (q.tags_pat == NULL && gen->tagdata && might_match_tags) {
+        CodeSearchImpl::TagsFirstSearch_(gen.get(), response, q, stats);
     } else if (q.tags_pat == NULL) {
-        code_searcher::search_thread *search;
-        if (!pool_.try_pop(&search))
-            search = new code_searcher::search_thread(cs_);
+        code_searcher::search_thread *search = gen->get_thread();
         add_match::line_set ls;
-        add_match cb(&ls, response);
+        add_match cb(&ls, response, &stats);
         search->match(q, cb, cb, &stats);
-        pool_.push(search);
+        gen->put_thread(search);
     } else {
-        if (tagdata_ == NULL)
+        if (gen->tagdata == NULL)
             return Status(StatusCode::FAILED_PRECONDITION, "No tags file available.");
 
         add_match::line_set ls;
-        add_match cb(&ls, response);
-        run_tags_search(q, tagdata_, cb, tagmatch_, stats);
+        add_match cb(&ls, response, &stats);
+        run_tags_search(q, gen->tagdata, cb, gen->tagmatch, stats);
     }
 
     auto out_stats = response->mutable_stats();
@@ -362,26 +551,115 @@ Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::
     out_stats->set_sort_time(timeval_ms(stats.sort_time));
     out_stats->set_index_time(timeval_ms(stats.index_time));
     out_stats->set_analyze_time(timeval_ms(stats.analyze_time));
+    out_stats->set_scan_bytes(stats.work.scan_bytes);
+    out_stats->set_candidates(stats.work.candidates);
+    out_stats->set_try_matches(stats.work.try_matches);
+    out_stats->set_partial(stats.partial);
+    out_stats->set_resident_bytes(stats.resident_bytes);
+    out_stats->set_nonresident_bytes(stats.nonresident_bytes);
+    out_stats->set_chunks_considered(stats.work.chunks_considered);
+    out_stats->set_chunks_skipped(stats.work.chunks_skipped);
+    out_stats->set_chunks_indexed(stats.work.chunks_indexed);
+    out_stats->set_chunks_scanned(stats.work.chunks_scanned);
+    out_stats->set_re2_calls(stats.work.re2_calls);
+    out_stats->set_find_match_nodes(stats.work.find_match_nodes);
+    out_stats->set_files_tried(stats.work.files_tried);
+    out_stats->set_files_accepted(stats.work.files_accepted);
+    out_stats->set_pieces_walked(stats.work.pieces_walked);
+    out_stats->set_results_deduped(stats.work.results_deduped);
+    out_stats->set_queue_wait_time(timeval_ms(stats.queue_wait));
+    out_stats->set_index_selectivity(stats.index_selectivity);
+    out_stats->set_index_depth(stats.index_depth);
+    out_stats->set_index_nodes(stats.index_nodes);
     switch (stats.why) {
     case kExitNone:
         out_stats->set_exit_reason(SearchStats::NONE);
         break;
     case kExitMatchLimit:
         out_stats->set_exit_reason(SearchStats::MATCH_LIMIT);
+        search_exit_match_limit.inc();
         break;
     case kExitTimeout:
         out_stats->set_exit_reason(SearchStats::TIMEOUT);
+        search_exit_timeout.inc();
+        break;
+    case kExitWorkLimit:
+        out_stats->set_exit_reason(SearchStats::WORK_LIMIT);
+        search_exit_work_limit.inc();
         break;
     }
 
+    search_analyze_time.observe(timeval_us(stats.analyze_time));
+    search_index_time.observe(timeval_us(stats.index_time));
+    search_sort_time.observe(timeval_us(stats.sort_time));
+    search_re2_time.observe(timeval_us(stats.re2_time));
+    search_git_time.observe(timeval_us(stats.git_time));
+    search_results.observe(response->results_size());
+    slow_queries().maybe_add(q.trace_id, *request, *out_stats,
+                             timeval_ms(metrics.tm.elapsed()));
+
+    if (timeline) {
+        timeline->add("search", search_start, timeline->now(),
+                      "results", response->results_size());
+        response->set_trace(timeline->json());
+    }
+
     return Status::OK;
 }
 
 Status CodeSearchImpl::Reload(ServerContext* context, const ::Empty* request, ::Empty* response) {
     log("Reload()");
+    if (loader_) {
+        if (reloading_.exchange(true))
+            return Status(StatusCode::UNAVAILABLE, "reload already in progress");
+        if (reloader_.joinable())
+            reloader_.join();
+        reloader_ = std::thread(&CodeSearchImpl::hot_reload, this);
+        return Status::OK;
+    }
     if (reload_request_ == NULL) {
       return Status(StatusCode::UNIMPLEMENTED, "reload rpc not enabled");
     }
     reload_request_->set_value();
     return Status::OK;
 }
+
+Status CodeSearchImpl::Metrics(ServerContext* context, const ::Empty* request, ::MetricsReply* response) {
+    std::shared_ptr<index_generation> gen = current();
+    index_chunks_loaded.set(gen->cs->ready_chunks());
+    index_chunks_total.set(gen->cs->total_chunks());
+    response->set_text(metric::dump_prometheus());
+    return Status::OK;
+}
+
+Status CodeSearchImpl::SlowQueries(ServerContext* context, const ::Empty* request, ::SlowQueriesReply* response) {
+    response->set_json(slow_queries().json());
+    return Status::OK;
+}
+
+void CodeSearchImpl::hot_reload() {
+    timer tm;
+    std::unique_ptr<code_searcher> cs, tagdata;
+    string error;
+    if (!loader_(&cs, &tagdata, &error)) {
+        log(string(), "reload: keeping the current index: %s", error.c_str());
+        reloading_ = false;
+        return;
+    }
+
+    std::shared_ptr<index_generation> gen = new_generation(cs.get(), tagdata.get());
+    gen->owned_cs = std::move(cs);
+    gen->owned_tagdata = std::move(tagdata);
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        current_.swap(gen);
+        // Anyone who can see the new index may ask for the next one.
+        reloading_ = false;
+    }
+    struct timeval elapsed = tm.elapsed();
+    log("reload: switched to the new index after %d.%06ds",
+        (int)elapsed.tv_sec, (int)elapsed.tv_usec);
+    // Drop our reference to the old generation only now, outside the
+    // lock; whoever holds the last one hands it to the reaper.
+    gen.reset();
+}
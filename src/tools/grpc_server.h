@@ -2,6 +2,7 @@
 #define CODESEARCH_GRPC_SERVER_H
 
 #include "src/proto/livegrep.grpc.pb.h"
+#include <functional>
 #include <future>
 #include <memory>
 
@@ -12,4 +13,21 @@ std::unique_ptr<CodeSearch::Service> build_grpc_server(code_searcher *cs,
                                                        code_searcher *tagdata,
                                                        std::promise<void> *reload_request);
 
+// Builds a fresh index, and optionally a tags index, for a hot reload.
+// Returns false, with the reason in *error, if it could not.
+typedef std::function<bool (std::unique_ptr<code_searcher> *cs,
+                            std::unique_ptr<code_searcher> *tagdata,
+                            std::string *error)> index_loader;
+
+/*
+ * Like the above, but the server owns its index, and the Reload RPC
+ * runs `loader' on a background thread and then switches new requests
+ * over to the index it built. Requests already running finish on the
+ * old index, which is freed after the last of them. If `loader' fails,
+ * the server keeps the index it has.
+ */
+std::unique_ptr<CodeSearch::Service> build_grpc_server(std::unique_ptr<code_searcher> cs,
+                                                       std::unique_ptr<code_searcher> tagdata,
+                                                       const index_loader &loader);
+
 #endif /* CODESEARCH_GRPC_SERVER_H */
@@ -14,6 +14,9 @@
 
 #include "src/dump_load.h"
 #include "src/codesearch.h"
+#include "src/chunk.h"
+#include "src/line_directory.h"
+#include "src/postings.h"
 
 #include <gflags/gflags.h>
 
@@ -98,48 +101,86 @@ int inspect_index(int argc, char **argv) {
     }
     printf(" Content chunks: %d (%ldM)\n",
            idx->ncontent, content_size >> 20);
-    uint8_t *p = map + idx->files_off;
-    for (int i = 0; i < idx->nfiles; i++) {
-        p += 4;
-        p += 4 + *reinterpret_cast<uint32_t*>(p);
-    }
     spans.push_back(index_span(idx->files_off,
-                               (unsigned long)(p - map),
+                               idx->files_off + idx->nfiles * sizeof(file_header),
                                "file list" ));
 
-    printf(" Filename data: %ld (%0.2fM)\n",
-           (p - (map + idx->files_off)),
-           (p - (map + idx->files_off))/double(1<<20));
+    unsigned long filenames_size = sizeof(uint32_t) *
+        (idx->nfiles + 1 + (unsigned long)idx->filename_data_size) +
+        idx->filename_data_size;
+    spans.push_back(index_span(idx->filenames_off,
+                               idx->filenames_off + filenames_size,
+                               "filename index" ));
+    printf(" Filename data: %d (%0.2fM)\n",
+           idx->filename_data_size,
+           idx->filename_data_size / double(1<<20));
+    printf(" Filename index: %ld (%0.2fM)\n",
+           filenames_size,
+           filenames_size / double(1<<20));
 
     unsigned long chunk_file_size = 0;
+    unsigned long postings_size = 0;
+    unsigned long lines_size = 0;
+    unsigned long scan_only_chunks = 0;
     chunk_header *chunks = reinterpret_cast<chunk_header*>
         (map + idx->chunks_off);
     spans.push_back(index_span(idx->chunks_off,
                                idx->chunks_off + idx->nchunks * sizeof(chunk_header),
                                "chunk headers" ));
     for (int i = 0; i < idx->nchunks; i++) {
-        spans.push_back(index_span(chunks[i].data_off,
-                                   chunks[i].data_off + idx->chunk_size,
-                                   strprintf("chunk %d", i)));
-        spans.push_back(index_span(chunks[i].data_off + idx->chunk_size,
-                                   chunks[i].data_off +
-                                   (1 + sizeof(uint32_t)) * idx->chunk_size,
-                                   strprintf("chunk %d indexes", i)));
-        p = map + chunks[i].files_off;
-        for (int j = 0; j < chunks[i].nfiles; ++j) {
-            uint32_t files = *reinterpret_cast<uint32_t*>(p);
-            p += 4;
-            p += files * 4;
-            p += 8;
+        if (chunks[i].flags & kChunkNoSuffixes) {
+            ++scan_only_chunks;
+            if (chunks[i].size)
+                spans.push_back(index_span(chunks[i].data_off,
+                                           chunks[i].data_off + chunks[i].size,
+                                           strprintf("chunk %d (no suffix array)", i)));
+        } else {
+            spans.push_back(index_span(chunks[i].data_off,
+                                       chunks[i].data_off + idx->chunk_size,
+                                       strprintf("chunk %d", i)));
+            spans.push_back(index_span(chunks[i].data_off + idx->chunk_size,
+                                       chunks[i].data_off +
+                                       (1 + sizeof(uint32_t)) * idx->chunk_size,
+                                       strprintf("chunk %d indexes", i)));
+        }
+        unsigned long ranges_size =
+            chunks[i].nranges * (sizeof(chunk_range) + sizeof(uint32_t)) +
+            chunks[i].nrange_files * sizeof(uint32_t);
+        unsigned long tree_bits_size = chunks[i].ntree_words * sizeof(uint64_t);
+        chunk_file_size += ranges_size + tree_bits_size;
+        if (ranges_size)
+            spans.push_back(index_span(chunks[i].ranges_off,
+                                       chunks[i].ranges_off + ranges_size,
+                                       strprintf("chunk %d file map", i)));
+        if (tree_bits_size)
+            spans.push_back(index_span(chunks[i].tree_bits_off,
+                                       chunks[i].tree_bits_off + tree_bits_size,
+                                       strprintf("chunk %d tree bits", i)));
+        if (chunks[i].postings_off) {
+            line_postings postings(map + chunks[i].postings_off);
+            postings_size += postings.mapped_size();
+            spans.push_back(index_span(chunks[i].postings_off,
+                                       chunks[i].postings_off + postings.mapped_size(),
+                                       strprintf("chunk %d line postings", i)));
+        }
+        if (chunks[i].lines_off) {
+            line_directory lines(map + chunks[i].lines_off);
+            lines_size += lines.mapped_size();
+            spans.push_back(index_span(chunks[i].lines_off,
+                                       chunks[i].lines_off + lines.mapped_size(),
+                                       strprintf("chunk %d line directory", i)));
         }
-        chunk_file_size += p - (map + chunks[i].files_off);
-        spans.push_back(index_span(chunks[i].files_off,
-                                   (unsigned long)(p - map),
-                                   strprintf("chunk %d file map", i)));
     }
+    printf(" Chunks without suffix arrays: %ld\n", scan_only_chunks);
     printf(" chunk_file data: %ld (%0.2fM)\n",
            chunk_file_size,
            chunk_file_size / double(1 << 20));
+    printf(" Line postings: %ld (%0.2fM)\n",
+           postings_size,
+           postings_size / double(1 << 20));
+    printf(" Line directory: %ld (%0.2fM)\n",
+           lines_size,
+           lines_size / double(1 << 20));
 
     if (FLAGS_dump_trees) {
         code_searcher cs;
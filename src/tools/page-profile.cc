@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+using std::string;
+using std::vector;
+
+DEFINE_int32(heatmap_width, 64, "Columns in the per-region heatmap (0 to skip it).");
+
+namespace {
+    struct profile_region {
+        string kind;
+        int index;
+        string name;
+        unsigned long pages;
+        vector<std::pair<unsigned long, unsigned long>> counts;
+        unsigned long touches;
+    };
+
+    const char kShades[] = " .:-=+*#%@";
+
+    // The shade for `n' touches per page, on a log scale up to `max'.
+    char shade(double n, double max) {
+        if (n <= 0)
+            return kShades[0];
+        int levels = sizeof(kShades) - 2;
+        int i = 1 + int(levels * log1p(n) / log1p(max));
+        return kShades[std::min(i, levels)];
+    }
+};
+
+/*
+ * Summarize a profile written by codesearch --page_profile: how many
+ * pages of each region queries touched, how much memory covers a given
+ * share of all touches, and where in each region the touches fell.
+ */
+int page_profile_report(int argc, char **argv) {
+    if (argc != 1) {
+        fprintf(stderr, "Usage: %s <options> PROFILE\n", gflags::GetArgv0());
+        return 1;
+    }
+    std::ifstream in(argv[0]);
+    string line;
+    unsigned long page_size;
+    if (!getline(in, line) ||
+        sscanf(line.c_str(), "page_profile %lu", &page_size) != 1) {
+        fprintf(stderr, "%s: not a page profile\n", argv[0]);
+        return 1;
+    }
+
+    vector<profile_region> regions;
+    while (getline(in, line)) {
+        if (line.compare(0, 7, "region ") == 0) {
+            std::istringstream fields(line.substr(7));
+            profile_region r;
+            fields >> r.kind >> r.index >> r.name >> r.pages;
+            r.touches = 0;
+            regions.push_back(r);
+            continue;
+        }
+        unsigned long page, n;
+        if (regions.empty() || sscanf(line.c_str(), "%lu %lu", &page, &n) != 2) {
+            fprintf(stderr, "%s: bad line: %s\n", argv[0], line.c_str());
+            return 1;
+        }
+        regions.back().counts.push_back(std::make_pair(page, n));
+        regions.back().touches += n;
+    }
+
+    // Totals by region name.
+    vector<string> names;
+    for (auto &r : regions)
+        if (std::find(names.begin(), names.end(), r.name) == names.end())
+            names.push_back(r.name);
+    printf("%-10s %12s %12s %14s\n", "region", "pages", "touched", "touches");
+    vector<unsigned long> all;
+    for (auto &name : names) {
+        unsigned long pages = 0, touched = 0, touches = 0;
+        for (auto &r : regions) {
+            if (r.name != name)
+                continue;
+            pages += r.pages;
+            touched += r.counts.size();
+            touches += r.touches;
+            for (auto &c : r.counts)
+                all.push_back(c.second);
+        }
+        printf("%-10s %12lu %12lu %14lu\n", name.c_str(), pages, touched, touches);
+    }
+
+    // The working-set curve: the memory needed to serve a given share
+    // of page touches from the hottest pages.
+    sort(all.rbegin(), all.rend());
+    unsigned long total = 0;
+    for (auto n : all)
+        total += n;
+    printf("\nWorking set:\n");
+    const double shares[] = {0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1.0};
+    size_t i = 0;
+    unsigned long seen = 0;
+    for (double share : shares) {
+        while (i < all.size() && seen < share * total)
+            seen += all[i++];
+        printf(" %6.1f%% of touches: %10lu pages (%0.2fM)\n",
+               100 * share, (unsigned long)i, i * page_size / double(1 << 20));
+    }
+
+    if (FLAGS_heatmap_width <= 0)
+        return 0;
+    printf("\nHeatmap (touches per page, log scale):\n");
+    for (auto &r : regions) {
+        if (r.pages == 0)
+            continue;
+        int width = std::min<unsigned long>(FLAGS_heatmap_width, r.pages);
+        vector<double> buckets(width, 0);
+        for (auto &c : r.counts)
+            buckets[c.first * width / r.pages] += c.second;
+        double max = 0;
+        for (int b = 0; b < width; b++) {
+            buckets[b] /= double(r.pages) / width;
+            max = std::max(max, buckets[b]);
+        }
+        string row;
+        for (int b = 0; b < width; b++)
+            row += shade(buckets[b], max);
+        printf(" %s %4d %-8s |%s|\n", r.kind.c_str(), r.index, r.name.c_str(), row.c_str());
+    }
+    return 0;
+}
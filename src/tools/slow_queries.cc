@@ -0,0 +1,67 @@
+#include "src/tools/slow_queries.h"
+
+#include "gflags/gflags.h"
+#include <google/protobuf/util/json_util.h>
+#include <json-c/json.h>
+
+#include <stdio.h>
+#include <time.h>
+
+DEFINE_int32(slow_query_ms, 1000, "Record queries that take at least this long in the slow query log (0 to not record by latency).");
+DEFINE_int32(slow_query_work_ms, 0, "Record queries whose phase timers add up to at least this long, across all search threads, in the slow query log (0 to not record by work).");
+DEFINE_int32(slow_query_log_size, 64, "The number of slow queries to keep.");
+
+using google::protobuf::util::MessageToJsonString;
+
+void slow_query_log::maybe_add(const std::string &trace_id, const Query &query,
+                               const SearchStats &stats, long latency_ms) {
+    long work_ms = stats.re2_time() + stats.git_time() + stats.sort_time() +
+        stats.index_time() + stats.analyze_time();
+    bool slow = (FLAGS_slow_query_ms != 0 && latency_ms >= FLAGS_slow_query_ms) ||
+        (FLAGS_slow_query_work_ms > 0 && work_ms >= FLAGS_slow_query_work_ms);
+    if (!slow || size_ == 0)
+        return;
+
+    entry e;
+    gettimeofday(&e.when, NULL);
+    e.trace_id = trace_id;
+    e.query = query;
+    e.stats = stats;
+    e.latency_ms = latency_ms;
+    e.work_ms = work_ms;
+
+    std::unique_lock<std::mutex> locked(mtx_);
+    if (entries_.size() == size_)
+        entries_.pop_front();
+    entries_.push_back(e);
+}
+
+std::string slow_query_log::json() const {
+    std::unique_lock<std::mutex> locked(mtx_);
+    std::string out = "{\"slow_queries\":[";
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        const entry &e = entries_[i];
+        char when[64], buf[256];
+        struct tm tm;
+        gmtime_r(&e.when.tv_sec, &tm);
+        strftime(when, sizeof when, "%Y-%m-%dT%H:%M:%S", &tm);
+        std::string query, stats;
+        MessageToJsonString(e.query, &query);
+        MessageToJsonString(e.stats, &stats);
+        snprintf(buf, sizeof buf,
+                 "%s\n{\"time\":\"%s.%06dZ\",\"latency_ms\":%ld,\"work_ms\":%ld,",
+                 i ? "," : "", when, int(e.when.tv_usec), e.latency_ms, e.work_ms);
+        out += buf;
+        json_object *id = json_object_new_string(e.trace_id.c_str());
+        out += "\"trace_id\":" + std::string(json_object_to_json_string(id));
+        json_object_put(id);
+        out += ",\"query\":" + query + ",\"stats\":" + stats + "}";
+    }
+    out += "]}\n";
+    return out;
+}
+
+slow_query_log &slow_queries() {
+    static slow_query_log log(FLAGS_slow_query_log_size);
+    return log;
+}
@@ -0,0 +1,47 @@
+#ifndef CODESEARCH_SLOW_QUERIES_H
+#define CODESEARCH_SLOW_QUERIES_H
+
+#include "src/proto/livegrep.pb.h"
+
+#include <sys/time.h>
+
+#include <deque>
+#include <mutex>
+#include <string>
+
+/*
+ * A flight recorder for slow queries: the last few queries that took
+ * longer than --slow_query_ms, or did more than --slow_query_work_ms of
+ * work across all threads, kept in memory with their statistics so
+ * that a slow period can be diagnosed after the fact.
+ */
+class slow_query_log {
+public:
+    struct entry {
+        struct timeval when;
+        std::string trace_id;
+        Query query;
+        SearchStats stats;
+        long latency_ms;
+        long work_ms;
+    };
+
+    explicit slow_query_log(size_t size) : size_(size) {}
+
+    // Record the query if it was slow enough.
+    void maybe_add(const std::string &trace_id, const Query &query,
+                   const SearchStats &stats, long latency_ms);
+
+    // The recorded queries, oldest first, as a JSON object.
+    std::string json() const;
+
+private:
+    size_t size_;
+    mutable std::mutex mtx_;
+    std::deque<entry> entries_;
+};
+
+// The log the search server records into.
+slow_query_log &slow_queries();
+
+#endif /* CODESEARCH_SLOW_QUERIES_H */
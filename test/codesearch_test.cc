@@ -1,10 +1,37 @@
 #include <string.h>
+#include <unistd.h>
+#include <fstream>
+#include <map>
+#include <thread>
 #include "gtest/gtest.h"
+#include "gflags/gflags.h"
+#include <json-c/json.h>
 
 #include "src/codesearch.h"
 #include "src/content.h"
+#include "src/line_directory.h"
+#include "src/lib/bounded_queue.h"
+#include "src/lib/metrics.h"
+#include "src/lib/query_trace.h"
 #include "src/tools/grpc_server.h"
 
+DECLARE_bool(line_postings);
+DECLARE_bool(line_directory);
+DECLARE_int64(thread_regex_max_mem);
+DECLARE_bool(inline_search);
+DECLARE_double(inline_max_selectivity);
+DECLARE_int32(inline_max_candidates);
+DECLARE_bool(order_chunks);
+DECLARE_string(huge_pages);
+DECLARE_bool(numa);
+DECLARE_int32(prefetch_chunks);
+DECLARE_string(scan_only_trees);
+DECLARE_bool(residency_order);
+DECLARE_int32(slow_query_ms);
+
+extern metric search_inline;
+extern metric search_inline_handoff;
+
 class codesearch_test : public ::testing::Test {
 protected:
     codesearch_test() {
@@ -16,6 +43,68 @@ protected:
     const indexed_tree *tree_;
 };
 
+/*
+ * Fixtures shared by the tests of the features that need an index
+ * spanning several chunks, or one that went through a dump and load.
+ */
+namespace {
+
+// `line', padded with dots to 99 characters, and a newline.
+string padded(string line) {
+    line.resize(99, '.');
+    return line + "\n";
+}
+
+// Give `cs' 4096-byte chunks, so that a few dozen files span several.
+void use_small_chunks(code_searcher *cs) {
+    chunk_allocator *alloc = make_mem_allocator();
+    alloc->set_chunk_size(4096);
+    cs->set_alloc(alloc);
+}
+
+// Index files /file0 ... /file<nfiles - 1> in `tree', each a single
+// padded line "<prefix> <i>".
+void index_padded_files(code_searcher *cs, const indexed_tree *tree,
+                        const string &prefix, int nfiles) {
+    for (int i = 0; i < nfiles; i++)
+        cs->index_file(tree, "/file" + std::to_string(i),
+                       padded(prefix + " " + std::to_string(i)));
+}
+
+// Build an index of `nfiles' one-line files "<prefix> <i>" in small
+// chunks, about 40 files to a chunk.
+void build_small_chunk_index(code_searcher *cs, int nfiles,
+                             const string &prefix = "needle") {
+    use_small_chunks(cs);
+    index_padded_files(cs, cs->open_tree("repo", 0, "REV0"), prefix, nfiles);
+    cs->finalize();
+}
+
+// Build an index of 40 files, each ten filler lines and then "needle
+// <i>", in small chunks.
+void build_needle_index(code_searcher *cs) {
+    use_small_chunks(cs);
+    const indexed_tree *tree = cs->open_tree("repo", 0, "REV0");
+    for (int i = 0; i < 40; i++) {
+        string contents;
+        for (int j = 0; j < 10; j++)
+            contents += "filler " + std::to_string(i) + " " + std::to_string(j) + "\n";
+        contents += "needle " + std::to_string(i) + "\n";
+        cs->index_file(tree, "/file" + std::to_string(i), contents);
+    }
+    cs->finalize();
+}
+
+// Dump `cs' and load the dump into `loaded'.
+void round_trip(code_searcher &cs, code_searcher *loaded) {
+    string path = ::testing::TempDir() + "codesearch_test_round_trip.idx";
+    cs.dump_index(path);
+    loaded->load_index(path);
+    unlink(path.c_str());
+}
+
+};
+
 const char *file1 = "The quick brown fox\n" \
     "jumps over the lazy\n\n\n" \
     "dog.\n";
@@ -236,6 +325,1083 @@ TEST_F(codesearch_test, MaxMatches) {
     }
 }
 
+TEST_F(codesearch_test, WorkBudgets) {
+    for (int i = 0; i < 20; i++) {
+        cs_.index_file(tree_, "/file" + std::to_string(i),
+                       "needle " + std::to_string(i) + "\nhaystack\n");
+    }
+    cs_.finalize();
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+    {
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("needle");
+        grpc::ServerContext ctx;
+        grpc::Status st = srv->Search(&ctx, &request, &matches);
+        ASSERT_TRUE(st.ok());
+        EXPECT_EQ(20, matches.results_size());
+        EXPECT_EQ(SearchStats::NONE, matches.stats().exit_reason());
+        EXPECT_EQ(20, matches.stats().try_matches());
+        EXPECT_LE(20, matches.stats().candidates());
+        EXPECT_LT(0, matches.stats().scan_bytes());
+    }
+    {
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("needle");
+        request.set_max_try_matches(5);
+        grpc::ServerContext ctx;
+        grpc::Status st = srv->Search(&ctx, &request, &matches);
+        ASSERT_TRUE(st.ok());
+        EXPECT_GE(5, matches.results_size());
+        EXPECT_EQ(SearchStats::WORK_LIMIT, matches.stats().exit_reason());
+    }
+    {
+        // On one thread, the budget cuts a search off at the same
+        // place every time.
+        gflags::FlagSaver saver;
+        FLAGS_inline_max_selectivity = 1;
+        for (int i = 0; i < 3; i++) {
+            CodeSearchResult matches;
+            Query request;
+            request.set_line("needle");
+            request.set_max_try_matches(5);
+            grpc::ServerContext ctx;
+            ASSERT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+            EXPECT_EQ(5, matches.results_size());
+            EXPECT_EQ(6, matches.stats().try_matches());
+            EXPECT_EQ(SearchStats::WORK_LIMIT, matches.stats().exit_reason());
+        }
+    }
+    {
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("n.*e");
+        request.set_max_scan_bytes(32);
+        grpc::ServerContext ctx;
+        grpc::Status st = srv->Search(&ctx, &request, &matches);
+        ASSERT_TRUE(st.ok());
+        EXPECT_GT(20, matches.results_size());
+        EXPECT_EQ(SearchStats::WORK_LIMIT, matches.stats().exit_reason());
+    }
+}
+
+TEST_F(codesearch_test, MaxFilesPerLine) {
+    for (int i = 0; i < 5; i++)
+        cs_.index_file(tree_, "/file" + std::to_string(i), "license\ncontents\n");
+    cs_.finalize();
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+    CodeSearchResult matches;
+    Query request;
+    request.set_line("contents");
+    request.set_max_files_per_line(2);
+    grpc::ServerContext ctx;
+    grpc::Status st = srv->Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+    ASSERT_EQ(2, matches.results_size());
+    EXPECT_EQ("/file0", matches.results(0).path());
+    EXPECT_EQ(0, matches.results(0).more_files());
+    EXPECT_EQ("/file1", matches.results(1).path());
+    EXPECT_EQ(2, matches.results(1).line_number());
+    EXPECT_EQ(3, matches.results(1).more_files());
+}
+
+TEST_F(codesearch_test, LinePostings) {
+    gflags::FlagSaver saver;
+    FLAGS_line_postings = true;
+    cs_.index_file(tree_, "/file0", "header\nneedle one\nfooter\n");
+    cs_.index_file(tree_, "/file1", "header\nneedle one\n");
+    cs_.index_file(tree_, "/file2", "needle two\nheader\nneedle two\n");
+    cs_.finalize();
+    FLAGS_line_postings = false;
+
+    string path = ::testing::TempDir() + "codesearch_test_postings.idx";
+    cs_.dump_index(path);
+    code_searcher loaded;
+    loaded.load_index(path);
+    unlink(path.c_str());
+
+    code_searcher *searchers[] = {&cs_, &loaded};
+    for (auto cs : searchers) {
+        std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(cs, nullptr, nullptr));
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("needle");
+        grpc::ServerContext ctx;
+        grpc::Status st = srv->Search(&ctx, &request, &matches);
+        ASSERT_TRUE(st.ok());
+
+        std::set<std::pair<string, int>> got;
+        for (auto &r : matches.results())
+            got.insert(std::make_pair(r.path(), int(r.line_number())));
+        std::set<std::pair<string, int>> want = {
+            {"/file0", 2}, {"/file1", 2}, {"/file2", 1}, {"/file2", 3},
+        };
+        EXPECT_EQ(want, got);
+
+        for (auto &r : matches.results()) {
+            if (r.path() == "/file0") {
+                ASSERT_EQ(1, r.context_before_size());
+                EXPECT_EQ("header", r.context_before(0));
+                ASSERT_EQ(1, r.context_after_size());
+                EXPECT_EQ("footer", r.context_after(0));
+            }
+        }
+
+        matches.Clear();
+        request.set_line("needle one");
+        request.set_max_files_per_line(1);
+        st = srv->Search(&ctx, &request, &matches);
+        ASSERT_TRUE(st.ok());
+        ASSERT_EQ(1, matches.results_size());
+        EXPECT_EQ("/file0", matches.results(0).path());
+        EXPECT_EQ(1, matches.results(0).more_files());
+    }
+}
+
+TEST_F(codesearch_test, LinePostingsSkipOversizedFile) {
+    gflags::FlagSaver saver;
+    FLAGS_line_postings = true;
+    // Alternating a repeated line with unique ones breaks the file
+    // into more pieces than its file_contents can hold.
+    string big;
+    for (int i = 0; i < 400000; i++)
+        big += "shared\nneedle " + std::to_string(i) + "\n";
+    cs_.index_file(tree_, "/big", big);
+    cs_.index_file(tree_, "/small", "needle 1\n");
+    cs_.finalize();
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+    CodeSearchResult matches;
+    Query request;
+    request.set_line("^needle 1$");
+    grpc::ServerContext ctx;
+    grpc::Status st = srv->Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+    ASSERT_EQ(1, matches.results_size());
+    EXPECT_EQ("/small", matches.results(0).path());
+}
+
+TEST(line_directory_test, MatchesLinearScan) {
+    string data;
+    for (int i = 0; i < 300; i++) {
+        data += string((i * 37) % 101, 'x');
+        if (i % 50 == 0)
+            data += string(3000, 'y');
+        data += '\n';
+    }
+    data += "\n\n\n";
+    line_directory lines;
+    lines.build(reinterpret_cast<const unsigned char*>(data.data()), data.size());
+    EXPECT_EQ(303, lines.nlines());
+    for (uint32_t pos = 0; pos < data.size(); pos++) {
+        size_t before = pos ? data.rfind('\n', pos - 1) : string::npos;
+        EXPECT_EQ(before == string::npos ? 0 : before, lines.newline_before(pos));
+        EXPECT_EQ(data.find('\n', pos), lines.newline_after(pos));
+    }
+    EXPECT_EQ(data.size(), lines.select(lines.nlines()));
+}
+
+TEST_F(codesearch_test, LineDirectory) {
+    gflags::FlagSaver saver;
+    string minified;
+    for (int i = 0; i < 40; i++)
+        minified += "var needle" + std::to_string(i) + " = 0; ";
+    FLAGS_line_directory = true;
+    cs_.index_file(tree_, "/file0", "header\n" + minified + "\nneedle\n");
+    cs_.index_file(tree_, "/file1", "no match here\nneedle\n");
+    cs_.finalize();
+    FLAGS_line_directory = false;
+
+    string path = ::testing::TempDir() + "codesearch_test_lines.idx";
+    cs_.dump_index(path);
+    code_searcher loaded;
+    loaded.load_index(path);
+    unlink(path.c_str());
+
+    code_searcher *searchers[] = {&cs_, &loaded};
+    for (auto cs : searchers) {
+        std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(cs, nullptr, nullptr));
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("needle");
+        grpc::ServerContext ctx;
+        grpc::Status st = srv->Search(&ctx, &request, &matches);
+        ASSERT_TRUE(st.ok());
+
+        std::set<std::pair<string, int>> got;
+        for (auto &r : matches.results())
+            got.insert(std::make_pair(r.path(), int(r.line_number())));
+        std::set<std::pair<string, int>> want = {
+            {"/file0", 2}, {"/file0", 3}, {"/file1", 2},
+        };
+        EXPECT_EQ(want, got);
+        EXPECT_EQ(3, matches.results_size());
+    }
+}
+
+TEST(dump_load_test, MatchesInMemoryIndex) {
+    string path = ::testing::TempDir() + "codesearch_test_dump.idx";
+    string streamed_path = ::testing::TempDir() + "codesearch_test_streamed.idx";
+    auto build = [](code_searcher *cs) {
+        const indexed_tree *trees[] = {
+            cs->open_tree("repo", 0, "REV0"),
+            cs->open_tree("other", 0, "REV1"),
+        };
+        for (int i = 0; i < 20; i++) {
+            cs->index_file(trees[i % 2], "/dir" + std::to_string(i % 3) + "/file" + std::to_string(i),
+                           "shared line\nneedle " + std::to_string(i) + "\nshared line\n");
+        }
+        cs->finalize();
+    };
+
+    code_searcher built;
+    built.set_alloc(make_mem_allocator());
+    build(&built);
+    built.dump_index(path);
+
+    code_searcher streamed;
+    streamed.set_alloc(make_dump_allocator(&streamed, streamed_path));
+    build(&streamed);
+
+    code_searcher loaded, streamed_loaded;
+    loaded.load_index(path);
+    streamed_loaded.load_index(streamed_path);
+    unlink(path.c_str());
+    unlink(streamed_path.c_str());
+
+    auto search = [](code_searcher *cs, const string &line, const string &repo,
+                     const string &file) {
+        std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(cs, nullptr, nullptr));
+        CodeSearchResult matches;
+        Query request;
+        request.set_line(line);
+        request.set_repo(repo);
+        request.set_file(file);
+        request.set_max_matches(1000);
+        grpc::ServerContext ctx;
+        grpc::Status st = srv->Search(&ctx, &request, &matches);
+        EXPECT_TRUE(st.ok());
+        std::set<string> got;
+        for (auto &r : matches.results()) {
+            string context;
+            for (auto &c : r.context_before())
+                context += c + "|";
+            got.insert(r.tree() + ":" + r.path() + ":" +
+                       std::to_string(r.line_number()) + ":" + context + r.line());
+        }
+        for (auto &r : matches.file_results())
+            got.insert(r.tree() + ":" + r.path());
+        return got;
+    };
+
+    const char *queries[][3] = {
+        {"needle", "", ""},
+        {"shared", "", ""},
+        {"needle", "other", ""},
+        {"shared", "", "dir1"},
+        {"file1", "", ""},
+    };
+    for (auto q : queries) {
+        std::set<string> want = search(&built, q[0], q[1], q[2]);
+        EXPECT_FALSE(want.empty());
+        EXPECT_EQ(want, search(&loaded, q[0], q[1], q[2])) << q[0];
+        EXPECT_EQ(want, search(&streamed_loaded, q[0], q[1], q[2])) << q[0];
+    }
+    EXPECT_EQ(10, search(&loaded, "needle", "other", "").size());
+}
+
+TEST_F(codesearch_test, ProgressiveLoad) {
+    for (int i = 0; i < 10; i++)
+        cs_.index_file(tree_, "/needle" + std::to_string(i), "needle\n");
+    cs_.finalize();
+    string path = ::testing::TempDir() + "codesearch_test_progressive.idx";
+    cs_.dump_index(path);
+
+    code_searcher loaded;
+    loaded.begin_load_index(path);
+    unlink(path.c_str());
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&loaded, nullptr, nullptr));
+
+    auto info = [&]() {
+        ServerInfo info;
+        InfoRequest request;
+        grpc::ServerContext ctx;
+        EXPECT_TRUE(srv->Info(&ctx, &request, &info).ok());
+        return info;
+    };
+    auto search = [&]() {
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("needle");
+        grpc::ServerContext ctx;
+        EXPECT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+        return matches;
+    };
+
+    EXPECT_EQ(0, info().chunks_loaded());
+    EXPECT_EQ(1, info().chunks_total());
+    EXPECT_FALSE(info().ready());
+    CodeSearchResult partial = search();
+    EXPECT_TRUE(partial.stats().partial());
+    EXPECT_EQ(0, partial.results_size());
+    // The filename index is part of the metadata.
+    EXPECT_EQ(10, partial.file_results_size());
+
+    loaded.load_chunks(true);
+    EXPECT_EQ(1, info().chunks_loaded());
+    EXPECT_TRUE(info().ready());
+    CodeSearchResult full = search();
+    EXPECT_FALSE(full.stats().partial());
+    EXPECT_EQ(10, full.results_size());
+}
+
+TEST(load_test, MakesFilesAndMetadataOnDemand) {
+    code_searcher cs;
+    use_small_chunks(&cs);
+    const indexed_tree *tree = cs.open_tree(
+        "repo", json_tokener_parse("{\"github\": \"example/repo\"}"), "REV0");
+    index_padded_files(&cs, tree, "needle", 100);
+    cs.finalize();
+    code_searcher first;
+    round_trip(cs, &first);
+    // The metadata is written back unparsed when a loaded index is
+    // dumped again.
+    code_searcher loaded;
+    round_trip(first, &loaded);
+
+    ASSERT_EQ(100, loaded.end_files() - loaded.begin_files());
+    int i = 0;
+    for (auto it = loaded.begin_files(); it != loaded.end_files(); ++it, ++i) {
+        indexed_file *f = *it;
+        EXPECT_EQ("/file" + std::to_string(i), f->path);
+        EXPECT_EQ("repo", f->tree->name);
+        EXPECT_EQ(i, f->no);
+        // Made once, then the same file each time.
+        EXPECT_EQ(f, *it);
+    }
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&loaded, nullptr, nullptr));
+    ServerInfo info;
+    InfoRequest request;
+    grpc::ServerContext ctx;
+    EXPECT_TRUE(srv->Info(&ctx, &request, &info).ok());
+    ASSERT_EQ(1, info.trees_size());
+    EXPECT_EQ("example/repo", info.trees(0).metadata().at("github"));
+}
+
+TEST(progressive_load_test, SharedLinesReachUnloadedChunks) {
+    code_searcher cs;
+    use_small_chunks(&cs);
+    const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+    // /a fills most of the first chunk and ends in "needle". /b shares
+    // that line, which stays in the first chunk, but the rest of /b
+    // goes in the second.
+    string a;
+    for (int i = 0; i < 40; i++)
+        a += padded("a " + std::to_string(i));
+    cs.index_file(tree, "/a", a + "needle\n");
+    string b = "needle\n";
+    for (int i = 0; i < 3; i++)
+        b += padded("b " + std::to_string(i));
+    cs.index_file(tree, "/b", b);
+    for (int i = 0; i < 40; i++)
+        cs.index_file(tree, "/filler" + std::to_string(i), padded("filler " + std::to_string(i)));
+    cs.finalize();
+    ASSERT_LT(2, cs.alloc()->size());
+
+    string path = ::testing::TempDir() + "codesearch_test_progressive_shared.idx";
+    cs.dump_index(path);
+    code_searcher loaded;
+    loaded.begin_load_index(path);
+    unlink(path.c_str());
+    loaded.load_chunks(false, 1);
+    ASSERT_EQ(1, loaded.ready_chunks());
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&loaded, nullptr, nullptr));
+    CodeSearchResult matches;
+    Query request;
+    request.set_line("^needle$");
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+    EXPECT_TRUE(matches.stats().partial());
+    ASSERT_EQ(2, matches.results_size());
+    for (auto &r : matches.results()) {
+        if (r.path() != "/b")
+            continue;
+        EXPECT_EQ(1, r.line_number());
+        // The context comes from the chunk that is not searchable yet.
+        ASSERT_EQ(3, r.context_after_size());
+        EXPECT_EQ(padded("b 0"), r.context_after(0) + "\n");
+        EXPECT_EQ(padded("b 2"), r.context_after(2) + "\n");
+    }
+}
+
+TEST_F(codesearch_test, LockAndWarmLoadedIndex) {
+    for (int i = 0; i < 10; i++)
+        cs_.index_file(tree_, "/needle" + std::to_string(i), "needle\n");
+    cs_.finalize();
+    // An in-memory index has nothing to lock.
+    EXPECT_EQ(0, cs_.lock_index(4));
+    string path = ::testing::TempDir() + "codesearch_test_lock.idx";
+    cs_.dump_index(path);
+
+    code_searcher loaded;
+    loaded.begin_load_index(path);
+    unlink(path.c_str());
+    loaded.set_warm(false);
+    loaded.load_chunks(true);
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&loaded, nullptr, nullptr));
+    auto ready = [&]() {
+        ServerInfo info;
+        InfoRequest request;
+        grpc::ServerContext ctx;
+        EXPECT_TRUE(srv->Info(&ctx, &request, &info).ok());
+        return info.ready();
+    };
+
+    EXPECT_FALSE(ready());
+    EXPECT_GT(loaded.lock_index(4), 0);
+    CodeSearchResult matches;
+    Query request;
+    request.set_line("needle");
+    grpc::ServerContext ctx;
+    EXPECT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+    EXPECT_EQ(10, matches.results_size());
+    loaded.set_warm(true);
+    EXPECT_TRUE(ready());
+}
+
+TEST(huge_pages_test, BuildAndLoad) {
+    gflags::FlagSaver saver;
+    FLAGS_huge_pages = "thp";
+    code_searcher cs;
+    cs.set_alloc(make_mem_allocator());
+    const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+    for (int i = 0; i < 10; i++)
+        cs.index_file(tree, "/file" + std::to_string(i),
+                      "needle " + std::to_string(i) + "\nhaystack\n");
+    cs.finalize();
+    code_searcher loaded;
+    round_trip(cs, &loaded);
+
+    code_searcher *searchers[] = {&cs, &loaded};
+    for (auto s : searchers) {
+        std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(s, nullptr, nullptr));
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("needle [0-4]");
+        grpc::ServerContext ctx;
+        ASSERT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+        EXPECT_EQ(5, matches.results_size());
+    }
+}
+
+TEST(numa_test, SearchesEveryChunk) {
+    gflags::FlagSaver saver;
+    FLAGS_numa = true;
+    code_searcher cs;
+    build_small_chunk_index(&cs, 200);
+    EXPECT_LT(4, cs.alloc()->end() - cs.alloc()->begin());
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs, nullptr, nullptr));
+    CodeSearchResult matches;
+    Query request;
+    request.set_line("needle");
+    request.set_max_matches(1000);
+    grpc::ServerContext ctx;
+    EXPECT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+    EXPECT_EQ(200, matches.results_size());
+}
+
+TEST(prefetch_test, ScansLoadedIndex) {
+    gflags::FlagSaver saver;
+    code_searcher cs;
+    build_small_chunk_index(&cs, 200, "line");
+    code_searcher loaded;
+    round_trip(cs, &loaded);
+    EXPECT_LT(4, loaded.alloc()->end() - loaded.alloc()->begin());
+
+    FLAGS_prefetch_chunks = 2;
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&loaded, nullptr, nullptr));
+    CodeSearchResult matches;
+    Query request;
+    // Has no index key, so every chunk is scanned.
+    request.set_line(".");
+    request.set_max_matches(1000);
+    grpc::ServerContext ctx;
+    EXPECT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+    EXPECT_EQ(200, matches.results_size());
+
+    // An indexed search reads ahead only the suffix-array pages its
+    // binary searches start on.
+    CodeSearchResult indexed;
+    request.set_line("line 1");
+    EXPECT_TRUE(srv->Search(&ctx, &request, &indexed).ok());
+    EXPECT_EQ(111, indexed.results_size());
+}
+
+// Index 60 files in each of a "hot" and an "archive" tree, and load a
+// dump of them into `loaded' with the archive's chunks scan-only.
+static void build_scan_only_index(code_searcher *loaded) {
+    code_searcher cs;
+    use_small_chunks(&cs);
+    for (const char *name : {"hot", "archive"})
+        index_padded_files(&cs, cs.open_tree(name, 0, "REV0"),
+                           string("needle ") + name, 60);
+    cs.finalize();
+    gflags::FlagSaver saver;
+    FLAGS_scan_only_trees = "arch.*";
+    round_trip(cs, loaded);
+}
+
+TEST(scan_only_chunks_test, ScansScanOnlyTrees) {
+    code_searcher first;
+    build_scan_only_index(&first);
+    // A scan-only chunk stays so when its index is dumped again.
+    code_searcher loaded;
+    round_trip(first, &loaded);
+
+    int scan_only = 0, indexed = 0;
+    for (auto it = loaded.alloc()->begin(); it != loaded.alloc()->end(); ++it) {
+        if ((*it)->suffixes)
+            ++indexed;
+        else
+            ++scan_only;
+    }
+    EXPECT_LT(0, scan_only);
+    EXPECT_LT(0, indexed);
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&loaded, nullptr, nullptr));
+    const char *queries[] = {"needle", "needle archive 1", "needle hot 1"};
+    int want[] = {120, 11, 11};
+    for (int i = 0; i < 3; i++) {
+        CodeSearchResult matches;
+        Query request;
+        request.set_line(queries[i]);
+        request.set_max_matches(1000);
+        grpc::ServerContext ctx;
+        EXPECT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+        EXPECT_EQ(want[i], matches.results_size()) << queries[i];
+    }
+}
+
+TEST(scan_only_chunks_test, InlineSearchHandsOffScanOnlyChunks) {
+    code_searcher loaded;
+    build_scan_only_index(&loaded);
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&loaded, nullptr, nullptr));
+    long inlined = search_inline.value();
+    long handed_off = search_inline_handoff.value();
+    CodeSearchResult matches;
+    Query request;
+    request.set_line("needle archive 12\\.");
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+    ASSERT_EQ(1, matches.results_size());
+    EXPECT_EQ("archive", matches.results(0).tree());
+    // The indexed chunks come first and are searched inline; the
+    // scan-only ones go to the search threads.
+    EXPECT_EQ(inlined + 1, search_inline.value());
+    EXPECT_EQ(handed_off + 1, search_inline_handoff.value());
+}
+
+TEST(residency_test, ReportsResidentBytes) {
+    gflags::FlagSaver saver;
+    code_searcher cs;
+    build_small_chunk_index(&cs, 100);
+    code_searcher loaded;
+    round_trip(cs, &loaded);
+    int64_t total = 0;
+    for (auto it = loaded.alloc()->begin(); it != loaded.alloc()->end(); ++it)
+        total += (*it)->size * (1 + sizeof(uint32_t));
+
+    FLAGS_residency_order = true;
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&loaded, nullptr, nullptr));
+    CodeSearchResult matches;
+    Query request;
+    request.set_line("needle");
+    request.set_max_matches(1000);
+    grpc::ServerContext ctx;
+    EXPECT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+    EXPECT_EQ(100, matches.results_size());
+    EXPECT_EQ(total, matches.stats().resident_bytes() +
+              matches.stats().nonresident_bytes());
+    // We just wrote the index, so it is in the page cache.
+    EXPECT_LT(0, matches.stats().resident_bytes());
+
+    // Reading ahead of the threads finds the same matches, and the
+    // residency estimates are reused.
+    FLAGS_prefetch_chunks = 2;
+    CodeSearchResult again;
+    EXPECT_TRUE(srv->Search(&ctx, &request, &again).ok());
+    EXPECT_EQ(100, again.results_size());
+    EXPECT_EQ(matches.stats().resident_bytes(), again.stats().resident_bytes());
+}
+
+TEST_F(codesearch_test, PageProfile) {
+    for (int i = 0; i < 10; i++)
+        cs_.index_file(tree_, "/file" + std::to_string(i),
+                       "needle " + std::to_string(i) + "\nhaystack\n");
+    cs_.finalize();
+    string path = ::testing::TempDir() + "codesearch_test.profile";
+    {
+        std::unique_ptr<code_searcher> cs(new code_searcher);
+        round_trip(cs_, cs.get());
+        cs->enable_page_profile(path, 0);
+        std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(cs.get(), nullptr, nullptr));
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("needle 3");
+        grpc::ServerContext ctx;
+        EXPECT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+        EXPECT_EQ(1, matches.results_size());
+    }
+
+    // The profile is written when the searcher goes away.
+    std::ifstream in(path);
+    string line, region;
+    std::map<string, int> touched;
+    ASSERT_TRUE(getline(in, line));
+    EXPECT_EQ("page_profile 4096", line);
+    while (getline(in, line)) {
+        if (line.compare(0, 7, "region ") == 0)
+            region = line.substr(0, line.rfind(' '));
+        else
+            touched[region]++;
+    }
+    unlink(path.c_str());
+    EXPECT_EQ(1, touched["region chunk 0 data"]);
+    EXPECT_EQ(1, touched["region chunk 0 suffixes"]);
+    EXPECT_EQ(1, touched["region chunk 0 ranges"]);
+    EXPECT_EQ(1, touched["region content 0 content"]);
+}
+
+TEST(hot_reload_test, SwitchesToNewIndex) {
+    auto build = [](const string &name) {
+        std::unique_ptr<code_searcher> cs(new code_searcher);
+        cs->set_alloc(make_mem_allocator());
+        cs->set_name(name);
+        const indexed_tree *tree = cs->open_tree("repo", 0, name);
+        cs->index_file(tree, "/file", "needle in " + name + "\n");
+        cs->finalize();
+        return cs;
+    };
+    std::atomic_int reloads(0);
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(
+        build("gen0"), nullptr,
+        [&](std::unique_ptr<code_searcher> *cs, std::unique_ptr<code_searcher> *tags,
+            string *error) {
+            *cs = build("gen" + std::to_string(++reloads));
+            return true;
+        }));
+
+    auto search = [&]() {
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("needle");
+        grpc::ServerContext ctx;
+        EXPECT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+        EXPECT_EQ(1, matches.results_size());
+        return matches.results_size() ? matches.results(0).line() : "";
+    };
+    auto name = [&]() {
+        ServerInfo info;
+        InfoRequest request;
+        grpc::ServerContext ctx;
+        EXPECT_TRUE(srv->Info(&ctx, &request, &info).ok());
+        return info.name();
+    };
+
+    EXPECT_EQ("needle in gen0", search());
+    for (int gen = 1; gen <= 2; gen++) {
+        Empty request, response;
+        grpc::ServerContext ctx;
+        ASSERT_TRUE(srv->Reload(&ctx, &request, &response).ok());
+        // Queries keep being answered, from one index or the other,
+        // until the reload lands.
+        string want = "gen" + std::to_string(gen);
+        for (int i = 0; i < 1000 && name() != want; i++) {
+            search();
+            usleep(1000);
+        }
+        ASSERT_EQ(want, name());
+        EXPECT_EQ("needle in " + want, search());
+    }
+}
+
+TEST(hot_reload_test, KeepsIndexWhenLoadFails) {
+    code_searcher cs;
+    build_small_chunk_index(&cs, 10);
+    string good = ::testing::TempDir() + "codesearch_test_reload_good.idx";
+    string stale = ::testing::TempDir() + "codesearch_test_reload_stale.idx";
+    cs.dump_index(good);
+    cs.dump_index(stale);
+    {
+        // Bump the version in the header.
+        std::fstream f(stale, std::ios::in | std::ios::out | std::ios::binary);
+        uint32_t version;
+        f.seekg(sizeof(uint32_t));
+        f.read(reinterpret_cast<char*>(&version), sizeof(version));
+        ++version;
+        f.seekp(sizeof(uint32_t));
+        f.write(reinterpret_cast<char*>(&version), sizeof(version));
+    }
+
+    std::unique_ptr<code_searcher> first(new code_searcher);
+    first->load_index(good);
+    first->set_name("first");
+    const char *paths[] = {"/nonexistent/codesearch_test.idx", stale.c_str(), good.c_str()};
+    vector<string> errors;
+    std::atomic_int attempts(0);
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(
+        std::move(first), nullptr,
+        [&](std::unique_ptr<code_searcher> *cs, std::unique_ptr<code_searcher> *tags,
+            string *error) {
+            cs->reset(new code_searcher);
+            bool ok = (*cs)->begin_load_index(paths[attempts], error);
+            if (!ok)
+                errors.push_back(*error);
+            else
+                (*cs)->load_chunks(false);
+            ++attempts;
+            return ok;
+        }));
+    auto name = [&]() {
+        ServerInfo info;
+        InfoRequest request;
+        grpc::ServerContext ctx;
+        EXPECT_TRUE(srv->Info(&ctx, &request, &info).ok());
+        return info.name();
+    };
+    auto reload = [&]() {
+        // Wait for the previous reload, if any, to finish.
+        for (int i = 0; i < 1000; i++) {
+            Empty request, response;
+            grpc::ServerContext ctx;
+            if (srv->Reload(&ctx, &request, &response).ok())
+                return true;
+            usleep(1000);
+        }
+        return false;
+    };
+
+    for (int i = 0; i < 2; i++) {
+        ASSERT_TRUE(reload());
+        for (int j = 0; j < 1000 && attempts <= i; j++)
+            usleep(1000);
+        EXPECT_EQ("first", name());
+    }
+    ASSERT_TRUE(reload());
+    for (int i = 0; i < 1000 && name() == "first"; i++)
+        usleep(1000);
+    EXPECT_EQ("", name());
+    unlink(good.c_str());
+    unlink(stale.c_str());
+
+    ASSERT_EQ(2u, errors.size());
+    EXPECT_NE(string::npos, errors[0].find("Cannot open")) << errors[0];
+    EXPECT_NE(string::npos, errors[1].find("version")) << errors[1];
+}
+
+TEST_F(codesearch_test, WorkCounters) {
+    for (int i = 0; i < 3; i++)
+        cs_.index_file(tree_, "/file" + std::to_string(i),
+                       "unique " + std::to_string(i) + "\nneedle\n");
+    cs_.finalize();
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+
+    CodeSearchResult matches;
+    Query request;
+    request.set_line("needle");
+    request.set_file("file[01]");
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+    EXPECT_EQ(2, matches.results_size());
+
+    const SearchStats &stats = matches.stats();
+    EXPECT_EQ(1, stats.chunks_considered());
+    EXPECT_EQ(0, stats.chunks_skipped());
+    EXPECT_EQ(stats.chunks_considered(), stats.chunks_indexed() + stats.chunks_scanned());
+    EXPECT_LE(1, stats.re2_calls());
+    // The shared line is stored once; the range tree yields all three
+    // files, of which the file pattern lets two through.
+    EXPECT_LE(1, stats.find_match_nodes());
+    EXPECT_EQ(2, stats.files_tried());
+    EXPECT_EQ(2, stats.files_accepted());
+    EXPECT_LE(2, stats.pieces_walked());
+    EXPECT_EQ(0, stats.results_deduped());
+}
+
+TEST_F(codesearch_test, SlowQueryLog) {
+    cs_.index_file(tree_, "/data/file1", file1);
+    cs_.finalize();
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+
+    // Every query is slow enough.
+    gflags::FlagSaver saver;
+    FLAGS_slow_query_ms = -1;
+    for (const char *pat : {"quick", "lazy"}) {
+        CodeSearchResult matches;
+        Query request;
+        request.set_line(pat);
+        grpc::ServerContext ctx;
+        ASSERT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+        EXPECT_EQ(1, matches.stats().chunks_indexed() + matches.stats().chunks_scanned());
+        EXPECT_GT(1, matches.stats().index_selectivity());
+    }
+
+    SlowQueriesReply reply;
+    grpc::ServerContext ctx;
+    Empty empty;
+    ASSERT_TRUE(srv->SlowQueries(&ctx, &empty, &reply).ok());
+    const string &json = reply.json();
+    EXPECT_EQ(0u, json.find("{\"slow_queries\":["));
+    size_t quick = json.find("\"query\":{\"line\":\"quick\"");
+    size_t lazy = json.find("\"query\":{\"line\":\"lazy\"");
+    ASSERT_NE(string::npos, quick);
+    ASSERT_NE(string::npos, lazy);
+    EXPECT_LT(quick, lazy);
+    EXPECT_NE(string::npos, json.find("\"indexSelectivity\":"));
+}
+
+TEST(query_trace_test, RecordsSearchSpans) {
+    code_searcher cs;
+    build_needle_index(&cs);
+    ASSERT_LT(1, cs.alloc()->end() - cs.alloc()->begin());
+
+    query_trace trace;
+    query q = {};
+    q.line_pat.reset(new RE2("needle"));
+    q.max_matches = 100;
+    q.trace = &trace;
+    int matches = 0;
+    match_stats stats = {};
+    {
+        code_searcher::search_thread search(&cs);
+        search.match(q, [&](const match_result *) { ++matches; },
+                     [](const file_result *) {}, &stats);
+    }
+    EXPECT_EQ(40, matches);
+
+    string json = trace.json();
+    EXPECT_EQ(0u, json.find("{\"traceEvents\":["));
+    for (const char *name : {"indexRE", "chunk", "suffix_search", "re2",
+                             "find_match", "try_match", "deliver_results", "result"})
+        EXPECT_NE(string::npos, json.find(string("{\"name\":\"") + name + "\",\"cat\":\"search\",\"ph\":\"X\""))
+            << name;
+    EXPECT_NE(string::npos, json.find("\"args\":{\"matches\":40}"));
+    EXPECT_NE(string::npos, json.find("\"dropped_events\":0}"));
+}
+
+TEST_F(codesearch_test, ThreadRegexBudget) {
+    // Lines of pseudo-random letters, none of them 'x'.
+    string contents;
+    unsigned seed = 1;
+    for (int i = 0; i < 2000; i++) {
+        for (int j = 0; j < 60; j++) {
+            seed = seed * 1103515245 + 12345;
+            contents += char('a' + (seed >> 16) % 23);
+        }
+        contents += '\n';
+    }
+    contents += "needle aaaaaaaaaaaaaax\n";
+    cs_.index_file(tree_, "/file0", contents);
+    cs_.finalize();
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+    gflags::FlagSaver saver;
+    int64_t saved = FLAGS_thread_regex_max_mem;
+    int64_t budgets[] = {saved, 32 << 10};
+    for (auto budget : budgets) {
+        FLAGS_thread_regex_max_mem = budget;
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("[a-q][^u-z]{13}x$");
+        grpc::ServerContext ctx;
+        grpc::Status st = srv->Search(&ctx, &request, &matches);
+        ASSERT_TRUE(st.ok());
+        ASSERT_EQ(1, matches.results_size());
+        EXPECT_EQ(2001, matches.results(0).line_number());
+    }
+}
+
+TEST(inline_search_test, MatchesThreadedSearch) {
+    gflags::FlagSaver saver;
+    code_searcher cs;
+    build_needle_index(&cs);
+    ASSERT_LT(1, cs.alloc()->end() - cs.alloc()->begin());
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs, nullptr, nullptr));
+    auto search = [&]() {
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("needle");
+        request.set_max_matches(100);
+        grpc::ServerContext ctx;
+        grpc::Status st = srv->Search(&ctx, &request, &matches);
+        EXPECT_TRUE(st.ok());
+        std::set<string> got;
+        for (auto &r : matches.results())
+            got.insert(r.path() + ":" + r.line());
+        EXPECT_EQ(matches.results_size(), got.size());
+        return got;
+    };
+
+    long ninline = search_inline.value();
+    long nhandoff = search_inline_handoff.value();
+    std::set<string> inlined = search();
+    EXPECT_EQ(40, inlined.size());
+    EXPECT_EQ(ninline + 1, search_inline.value());
+    EXPECT_EQ(nhandoff, search_inline_handoff.value());
+
+    FLAGS_inline_max_candidates = 0;
+    std::set<string> handed_off = search();
+    EXPECT_EQ(inlined, handed_off);
+    EXPECT_EQ(ninline + 2, search_inline.value());
+    EXPECT_EQ(nhandoff + 1, search_inline_handoff.value());
+
+    FLAGS_inline_search = false;
+    std::set<string> threaded = search();
+    EXPECT_EQ(inlined, threaded);
+    EXPECT_EQ(ninline + 2, search_inline.value());
+}
+
+TEST(order_chunks_test, SpreadsTruncatedResults) {
+    gflags::FlagSaver saver;
+    code_searcher cs;
+    use_small_chunks(&cs);
+    // Each tree's lines fill exactly one chunk.
+    for (int i = 0; i < 8; i++) {
+        const indexed_tree *tree = cs.open_tree("repo" + std::to_string(i), 0, "REV0");
+        string contents;
+        for (int j = 0; j < 40; j++) {
+            string line = (j ? "filler " : "needle ") +
+                std::to_string(i) + " " + std::to_string(j);
+            line.resize(99, '.');
+            contents += line + "\n";
+        }
+        cs.index_file(tree, "/file", contents);
+    }
+    cs.finalize();
+    ASSERT_EQ(8, cs.alloc()->end() - cs.alloc()->begin());
+
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs, nullptr, nullptr));
+    auto search = [&](int max_matches) {
+        CodeSearchResult matches;
+        Query request;
+        request.set_line("needle");
+        request.set_max_matches(max_matches);
+        grpc::ServerContext ctx;
+        grpc::Status st = srv->Search(&ctx, &request, &matches);
+        EXPECT_TRUE(st.ok());
+        std::set<string> got;
+        for (auto &r : matches.results())
+            got.insert(r.tree());
+        return got;
+    };
+
+    std::set<string> unordered = search(100);
+    EXPECT_EQ(8, unordered.size());
+
+    FLAGS_order_chunks = true;
+    EXPECT_EQ(unordered, search(100));
+    // Run the query inline, so chunks are searched one at a time in
+    // dispatch order: the second is halfway through the index.
+    FLAGS_inline_max_selectivity = 1;
+    std::set<string> truncated = search(2);
+    EXPECT_EQ((std::set<string>{"repo0", "repo4"}), truncated);
+}
+
+TEST(bounded_queue_test, ManyProducersManyConsumers) {
+    const int kProducers = 4, kConsumers = 4, kItems = 20000;
+    bounded_queue<long> queue(16);
+    std::atomic_long sum(0), count(0);
+
+    vector<std::thread> consumers;
+    for (int i = 0; i < kConsumers; i++) {
+        consumers.emplace_back([&]() {
+            long v;
+            while (queue.pop(&v)) {
+                sum += v;
+                ++count;
+            }
+        });
+    }
+    vector<std::thread> producers;
+    for (int i = 0; i < kProducers; i++) {
+        producers.emplace_back([&, i]() {
+            for (long v = 1; v <= kItems; v++)
+                queue.push(v * (i + 1));
+        });
+    }
+    for (auto &t : producers)
+        t.join();
+    queue.close();
+    for (auto &t : consumers)
+        t.join();
+
+    EXPECT_EQ(kProducers * kItems, count.load());
+    EXPECT_EQ(long(kItems) * (kItems + 1) / 2 * (kProducers * (kProducers + 1) / 2),
+              sum.load());
+    long v;
+    EXPECT_FALSE(queue.pop(&v));
+}
+
+TEST(metrics_test, HistogramAcrossThreads) {
+    const int kThreads = 8, kValues = 1000;
+    histogram h("test.histogram", 10, 10, 3);
+    vector<std::thread> threads;
+    for (int i = 0; i < kThreads; i++) {
+        threads.emplace_back([&]() {
+            for (long v = 1; v <= kValues; v++)
+                h.observe(v);
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    histogram::snapshot snap = h.read();
+    ASSERT_EQ(3, snap.bounds.size());
+    EXPECT_EQ(100, snap.bounds[1]);
+    EXPECT_EQ(kThreads * 10, snap.counts[0]);
+    EXPECT_EQ(kThreads * 90, snap.counts[1]);
+    EXPECT_EQ(kThreads * 900, snap.counts[2]);
+    EXPECT_EQ(0, snap.counts[3]);
+    EXPECT_EQ(kThreads * kValues, snap.count);
+    EXPECT_EQ(long(kThreads) * kValues * (kValues + 1) / 2, snap.sum);
+
+    string text = metric::dump_prometheus();
+    EXPECT_NE(string::npos, text.find("# TYPE livegrep_test_histogram histogram\n"));
+    EXPECT_NE(string::npos, text.find("livegrep_test_histogram_bucket{le=\"100\"} 800\n"));
+    EXPECT_NE(string::npos, text.find("livegrep_test_histogram_bucket{le=\"+Inf\"} 8000\n"));
+}
+
+TEST_F(codesearch_test, MetricsRPC) {
+    cs_.index_file(tree_, "/data/file1", file1);
+    cs_.finalize();
+    std::unique_ptr<CodeSearch::Service> srv(build_grpc_server(&cs_, nullptr, nullptr));
+
+    CodeSearchResult matches;
+    Query request;
+    request.set_line("fox");
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv->Search(&ctx, &request, &matches).ok());
+
+    MetricsReply reply;
+    grpc::ServerContext mctx;
+    Empty empty;
+    ASSERT_TRUE(srv->Metrics(&mctx, &empty, &reply).ok());
+    const string &text = reply.text();
+    EXPECT_NE(string::npos, text.find("# TYPE livegrep_search_in_flight gauge\nlivegrep_search_in_flight 0\n"));
+    EXPECT_NE(string::npos, text.find("# TYPE livegrep_search_queries counter\n"));
+    EXPECT_NE(string::npos, text.find("# TYPE livegrep_search_latency_us histogram\n"));
+    EXPECT_NE(string::npos, text.find("livegrep_search_results_bucket{le=\"1\"} "));
+    EXPECT_NE(string::npos, text.find("livegrep_index_chunks_total 1\n"));
+}
+
 TEST_F(codesearch_test, LineCaseAndFileCaseAreIndependent) {
     cs_.index_file(tree_, "/file1", "contents");
     cs_.index_file(tree_, "/FILE2", "CONTENTS");